@@ -38,8 +38,24 @@ struct BosfsOptions {
 
     // cache and file manager configs
     std::string        cache_dir;
+    // bytes of cache_dir to keep, cold files that are not open are evicted beyond it
+    int64_t            cache_capacity = 0;
     int                meta_expires_s = 0;
     int                meta_capacity = -1;
+    int64_t            meta_memory_limit = 0;
+    int                meta_negative_expires_s = 0;
+    int                meta_negative_capacity = 10000;
+    int                meta_dir_expires_s = 0;
+    int                meta_max_stale_s = 0;
+    bool               stat_from_listing = false;
+    bool               meta_persist = false;
+    bool               kernel_cache = false;
+    std::string        meta_warmup_prefix;
+    int                meta_warmup_parallel = 8;
+    // mount read-only and serve the namespace from a file built by bosfs_build_snapshot()
+    std::string        snapshot_path;
+    // unix socket to receive invalidations on, see Bosfs::invalidate()
+    std::string        invalidate_socket;
     std::string        tmp_dir;
 
     // multipart upload options
@@ -80,6 +96,14 @@ public:
     ~Bosfs();
 
     int init_bos(BosfsOptions &bosfs_options, std::string &errmsg);
+    // write namespace below the mounted prefix to path, after init_bos()
+    int build_snapshot(const std::string &path, std::string &errmsg);
+
+    // forget meta and local data of path, which is relative to mountpoint, so changes
+    // made to it through other mounts show up before meta expires
+    int invalidate(const char *path);
+    // same for path and everything below it
+    int invalidate_prefix(const char *path);
 
     DataCache *data_cache();
     FileManager *file_manager();
@@ -131,6 +155,11 @@ int bosfs_prepare_fs_operations(
     Bosfs *bosfs, BosfsOptions &bosfs_options,
     struct fuse_operations &bosfs_operation, std::string &errmsg);
 
+// list bucket path once and write a namespace snapshot of it, no mountpoint needed
+int bosfs_build_snapshot(
+    const std::string &bucket_path, Bosfs *bosfs, BosfsOptions &bosfs_options,
+    const std::string &snapshot_path, std::string &errmsg);
+
 } // namespace bosfs
 } // namespace bos
 } // namespace baidu
@@ -20,16 +20,22 @@
 #include <sys/statvfs.h> // for statvfs
 #include <sys/types.h>   // for linux kernel system types
 
+#include <algorithm>
 #include <string>
 #include <limits.h>
 #include <sys/xattr.h>
 
 BEGIN_FS_NAMESPACE
 
+// kernel cache timeout when meta never expires
+enum { MAX_KERNEL_CACHE_S = 86400 };
+
 BosfsImpl::BosfsImpl()
     : _bosfs_util(),
       _file_manager(&_bosfs_util),
-      _data_cache(&_bosfs_util, &_file_manager) {
+      _data_cache(&_bosfs_util, &_file_manager),
+      _meta_warmer(&_bosfs_util, &_file_manager),
+      _invalidation_listener(this) {
     _bosfs_util.set_file_manager(&_file_manager);
     _bosfs_util.set_data_cache(&_data_cache);
 }
@@ -49,6 +55,10 @@ int BosfsImpl::init_bos(BosfsOptions &bosfs_options, std::string &errmsg) {
     return _bosfs_util.init_bos(bosfs_options, errmsg);
 }
 
+int BosfsImpl::build_snapshot(const std::string &path, std::string &errmsg) {
+    return NamespaceSnapshot::build(&_bosfs_util, path, errmsg);
+}
+
 void BosfsImpl::init(struct fuse_conn_info *conn, fuse_config *cfg) {
     BOSFS_INFO("fuse init");
     cfg->use_ino = 0;
@@ -57,16 +67,60 @@ void BosfsImpl::init(struct fuse_conn_info *conn, fuse_config *cfg) {
     cfg->entry_timeout = 0;
     cfg->attr_timeout = 0;
     cfg->negative_timeout = 0;
+    const BosfsOptions &options = _bosfs_util.options();
+    if (options.kernel_cache) {
+        int timeout = options.meta_expires_s > 0 ? options.meta_expires_s : MAX_KERNEL_CACHE_S;
+        cfg->entry_timeout = timeout;
+        cfg->attr_timeout = timeout;
+        cfg->negative_timeout = std::max(options.meta_negative_expires_s, 0);
+        _bosfs_util.set_fuse(_bosfs_util.fuse_get_context()->fuse);
+        _file_manager.set_kernel_cache(true);
+    }
 
 #ifndef __APPLE__
     if (static_cast<unsigned int>(conn->capable) & FUSE_CAP_ATOMIC_O_TRUNC) {
         conn->want |= FUSE_CAP_ATOMIC_O_TRUNC;
     }
 #endif
+    // start background workers here, fuse has already forked to background
+    _file_manager.start();
+    // a snapshot has the whole namespace already
+    if (!options.meta_warmup_prefix.empty() && !_file_manager.has_snapshot()) {
+        _meta_warmer.start(options.meta_warmup_prefix, options.meta_warmup_parallel);
+    }
+    if (!options.invalidate_socket.empty()) {
+        _invalidation_listener.start(options.invalidate_socket);
+    }
+    _data_cache.start_eviction();
 }
 
 void BosfsImpl::destroy() {
     BOSFS_INFO("fuse destroy");
+    _invalidation_listener.stop();
+    _data_cache.stop_eviction();
+    _meta_warmer.stop();
+    _file_manager.stop();
+}
+
+int BosfsImpl::invalidate(const char *path) {
+    BOSFS_INFO("invalidate [path=%s]", path);
+    std::string realpath = _bosfs_util.get_real_path(path);
+    _file_manager.del(realpath);
+    _data_cache.invalidate(realpath.c_str(), false);
+    // mode or owner of a directory may have changed
+    _bosfs_util.invalidate_access_cache();
+    return 0;
+}
+
+int BosfsImpl::invalidate_prefix(const char *path) {
+    BOSFS_INFO("invalidate prefix [path=%s]", path);
+    std::string realpath = _bosfs_util.get_real_path(path);
+    _file_manager.del_subtree(realpath);
+    // names under prefix known not to exist may have been created
+    _file_manager.invalidate_negatives();
+    _data_cache.invalidate(realpath.c_str(), true);
+    _bosfs_util.invalidate_access_cache();
+    return 0;
 }
 
 int BosfsImpl::access(const char *path, int mask) {
@@ -83,6 +137,9 @@ int BosfsImpl::access(const char *path, int mask) {
 
 int BosfsImpl::create(const char *path, mode_t mode, struct fuse_file_info *fi)
 {
+    if (_file_manager.has_snapshot()) {
+        return -EROFS;
+    }
     BOSFS_INFO("create [path=%s][mode=%04o][flags=%d]", path, mode, fi->flags);
     std::string realpath = _bosfs_util.get_real_path(path);
     path = realpath.c_str();
@@ -104,9 +161,9 @@ int BosfsImpl::create(const char *path, mode_t mode, struct fuse_file_info *fi)
         return -EIO;
     }
     ent->set_modified(true);
-    FilePtr file(new File(&_bosfs_util, path));
-    file->meta().move_from(*meta);
-    _file_manager.set(path, file);
+    FilePtr file = make_ref<File>(&_bosfs_util, path);
+    file->set_meta(*meta);
+    _file_manager.set(path, file, true);
     fi->fh = (int64_t) ent;
     return 0;
 }
@@ -114,6 +171,9 @@ int BosfsImpl::create(const char *path, mode_t mode, struct fuse_file_info *fi)
 int BosfsImpl::open(const char *path, struct fuse_file_info *fi)
 {
     BOSFS_INFO("open [path=%s][flags=%d]", path, fi->flags);
+    if (_file_manager.has_snapshot() && (fi->flags & (O_WRONLY | O_RDWR | O_TRUNC))) {
+        return -EROFS;
+    }
     std::string realpath = _bosfs_util.get_real_path(path);
     path = realpath.c_str();
     int ret = _bosfs_util.check_parent_object_access(path, X_OK);
@@ -227,6 +287,9 @@ int BosfsImpl::statfs(const char *path, struct statvfs *stbuf) {
 }
 
 int BosfsImpl::symlink(const char *target, const char *path) {
+    if (_file_manager.has_snapshot()) {
+        return -EROFS;
+    }
     BOSFS_INFO("symlink %s -> %s", path, target);
     std::string realpath = _bosfs_util.get_real_path(path);
     path = realpath.c_str();
@@ -251,7 +314,6 @@ int BosfsImpl::symlink(const char *target, const char *path) {
     if (ret != 0) {
         return -EIO;
     }
-    _file_manager.del(path);
     return 0;
 }
 
@@ -262,6 +324,9 @@ int BosfsImpl::link(const char *from, const char *to) {//not implemented
 }
 
 int BosfsImpl::unlink(const char *path) {
+    if (_file_manager.has_snapshot()) {
+        return -EROFS;
+    }
     // search permission of path components and write permission of parent directory
     std::string realpath = _bosfs_util.get_real_path(path);
     path = realpath.c_str();
@@ -310,6 +375,9 @@ int BosfsImpl::readlink(const char *path, char *buf, size_t size) {
 }
 
 int BosfsImpl::mknod(const char *path, mode_t mode, dev_t rdev) {
+    if (_file_manager.has_snapshot()) {
+        return -EROFS;
+    }
     BOSFS_INFO("mknod [path=%s][mode=%04o][dev=%ju]", path, mode, rdev);
     std::string realpath = _bosfs_util.get_real_path(path);
     path = realpath.c_str();
@@ -336,11 +404,13 @@ int BosfsImpl::mknod(const char *path, mode_t mode, dev_t rdev) {
         BOSFS_ERR("could not create object for special file, result = %d", ret);
         return -EIO;
     }
-    _file_manager.del(path);
     return ret;
 }
 
 int BosfsImpl::mkdir(const char *path, mode_t mode) {
+    if (_file_manager.has_snapshot()) {
+        return -EROFS;
+    }
     BOSFS_INFO("mkdir [path=%s][mode=%04o]", path, mode);
     std::string realpath = _bosfs_util.get_real_path(path);
     path = realpath.c_str();
@@ -368,11 +438,13 @@ int BosfsImpl::mkdir(const char *path, mode_t mode) {
     if (ret != 0) {
         return -EIO;
     }
-    _file_manager.del(path);
     return 0;
 }
 
 int BosfsImpl::rmdir(const char *path) {
+    if (_file_manager.has_snapshot()) {
+        return -EROFS;
+    }
     std::string realpath = _bosfs_util.get_real_path(path);
     path = realpath.c_str();
     std::string object_name(path + 1);
@@ -402,6 +474,7 @@ int BosfsImpl::rmdir(const char *path) {
     }
     // force refresh meta info, may be delete is success but response is timeout
     _file_manager.del(path);
+    _bosfs_util.invalidate_access_cache();
     if (ret != 0) {
         if (ret == BOSFS_OBJECT_NOT_EXIST) {
             return -ENOENT;
@@ -414,6 +487,9 @@ int BosfsImpl::rmdir(const char *path) {
 // rename between local and bos, fuse will convert to copy and unlink
 // so this rename() call only happens in the mountpoint
 int BosfsImpl::rename(const char *from, const char *to, unsigned int flags) {
+    if (_file_manager.has_snapshot()) {
+        return -EROFS;
+    }
     BOSFS_INFO("rename [from=%s][to=%s][flags=%u]", from, to, flags);
     if (flags) {
         // renameat2 is not supported
@@ -435,15 +511,16 @@ int BosfsImpl::rename(const char *from, const char *to, unsigned int flags) {
         return ret;
     }
 
-    // existence of src
+    // existence of src, its type decides how it is renamed
     struct stat st;
-    ret = _bosfs_util.get_object_attribute(from, &st);
+    ret = _bosfs_util.get_object_attribute(from, &st, NULL, true);
     if (ret != 0) {
         return ret;
     }
 
     if (S_ISDIR(st.st_mode)) { // rename directory
         ret = _bosfs_util.rename_directory(from + 1, to + 1);
+        _bosfs_util.invalidate_access_cache();
     } else {
         ret = _bosfs_util.rename_file(from + 1, to + 1, st.st_size);
     }
@@ -484,23 +561,65 @@ int BosfsImpl::readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_
     if (!path_.empty()) {
         prefix = prefix + "/";
     }
+    struct stat default_st;
+    _bosfs_util.init_default_stat(&default_st);
+    std::string real_dir = prefix.empty() ? "/" : _bosfs_util.object_to_path(prefix);
+    DirEntryList children;
+    // a snapshot has attributes of all children at hand and is never listed from bos
+    bool snapshot = _file_manager.has_snapshot();
+    if (_file_manager.get_dir_children(real_dir, &children)) {
+        std::string child_prefix = real_dir == "/" ? real_dir : real_dir + "/";
+        for (size_t i = 0; i < children.size(); ++i) {
+            struct stat st = default_st;
+            FilePtr file;
+            bool found = snapshot
+                ? _file_manager.get(child_prefix + children[i].name, &file) == 0
+                : _file_manager.try_get(child_prefix + children[i].name, &file);
+            if (found) {
+                file->stat(&st);
+            } else if (!children[i].is_dir) {
+                st.st_mode &= ~(S_IFMT | 0111);
+                st.st_mode |= S_IFREG;
+            }
+            if (filler(buf, children[i].name.c_str(), &st, 0, fill_flags)) {
+                break;
+            }
+        }
+        return 0;
+    }
+    if (snapshot) {
+        return -ENOENT;
+    }
+    // listing is recorded only if it was delivered completely and nothing changed meanwhile
+    uint64_t generation = _file_manager.dir_generation(real_dir);
+    bool complete = true;
+    bool stat_from_listing = _bosfs_util.options().stat_from_listing;
     std::string marker;
     do {
         std::vector<std::string> items;
+        std::vector<ObjectSummary> summaries;
         std::vector<std::string> prefixes;
-        int ret = _bosfs_util.list_objects(prefix, 1000, marker, "/", &items, &prefixes);
+        int ret = 0;
+        if (stat_from_listing) {
+            ret = _bosfs_util.list_objects(prefix, 1000, marker, "/", &summaries, &prefixes);
+            for (size_t i = 0; i < summaries.size(); ++i) {
+                items.push_back(summaries[i].key);
+            }
+        } else {
+            ret = _bosfs_util.list_objects(prefix, 1000, marker, "/", &items, &prefixes);
+        }
         if (ret != 0) {
             return -EIO;
         }
-        struct stat default_st;
-        _bosfs_util.init_default_stat(&default_st);
         for (size_t i = 0; i < prefixes.size(); ++i) {
             std::string dir_path = _bosfs_util.object_to_path(prefixes[i]);
-            FilePtr file(new File(&_bosfs_util, dir_path));
+            FilePtr file = make_ref<File>(&_bosfs_util, dir_path);
             file->set_is_prefix(true);
             _file_manager.set(dir_path, file);
             std::string basename = _bosfs_util.object_to_basename(prefixes[i], prefix);
+            children.push_back(DirEntry(basename, true));
             if (filler(buf, basename.c_str(), &default_st, 0, fill_flags)) {
+                complete = false;
                 break;
             }
         }
@@ -509,8 +628,14 @@ int BosfsImpl::readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_
         std::vector<struct stat *> no_cache_stats;
         for (size_t i = 0; i < items.size(); ++i) {
             FilePtr file;
-            if (_file_manager.try_get(_bosfs_util.object_to_path(items[i]), &file)) {
+            std::string item_path = _bosfs_util.object_to_path(items[i]);
+            if (_file_manager.try_get(item_path, &file)) {
                 file->stat(&stats[i]);
+            } else if (stat_from_listing) {
+                file = make_ref<File>(&_bosfs_util, item_path);
+                file->set_from_summary(summaries[i]);
+                file->stat(&stats[i]);
+                _file_manager.set(item_path, file);
             } else {
                 no_cache_items.push_back(items[i]);
                 no_cache_stats.push_back(&stats[i]);
@@ -519,11 +644,16 @@ int BosfsImpl::readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_
         _bosfs_util.multiple_head_object(no_cache_items, no_cache_stats);
         for (size_t i = 0; i < items.size(); ++i) {
             std::string basename = _bosfs_util.object_to_basename(items[i], prefix);
+            children.push_back(DirEntry(basename, *items[i].rbegin() == '/'));
             if (filler(buf, basename.c_str(), &stats[i], 0, fill_flags)) {
+                complete = false;
                 break;
             }
         }
     } while (!marker.empty());
+    if (complete) {
+        _file_manager.set_dir_children(real_dir, children, generation);
+    }
     return 0;
 }
 
@@ -535,6 +665,9 @@ int BosfsImpl::releasedir(const char* path, struct fuse_file_info *fi) {
 }
 
 int BosfsImpl::chmod(const char *path, mode_t mode, fuse_file_info *fi) {
+    if (_file_manager.has_snapshot()) {
+        return -EROFS;
+    }
     std::string realpath;
     if (fi != nullptr) {
         DataCacheEntity *ent = (DataCacheEntity *) fi->fh;
@@ -560,7 +693,7 @@ int BosfsImpl::chmod(const char *path, mode_t mode, fuse_file_info *fi) {
         return ret;
     }
     ObjectMetaData meta;
-    ret = _bosfs_util.get_object_attribute(path, &st, &meta);
+    ret = _bosfs_util.get_object_attribute_for_update(path, &st, &meta);
     if (ret != 0) {
         return ret;
     }
@@ -581,11 +714,16 @@ int BosfsImpl::chmod(const char *path, mode_t mode, fuse_file_info *fi) {
         }
         return ret;
     }
-    _file_manager.del(path);
+    if (S_ISDIR(st.st_mode)) {
+        _bosfs_util.invalidate_access_cache();
+    }
     return 0;
 }
 
 int BosfsImpl::chown(const char *path, uid_t uid, gid_t gid, fuse_file_info *fi) {
+    if (_file_manager.has_snapshot()) {
+        return -EROFS;
+    }
     std::string realpath;
     if (fi != nullptr) {
         DataCacheEntity *ent = (DataCacheEntity *) fi->fh;
@@ -616,7 +754,7 @@ int BosfsImpl::chown(const char *path, uid_t uid, gid_t gid, fuse_file_info *fi)
     }
     struct stat st;
     ObjectMetaData meta;
-    ret = _bosfs_util.get_object_attribute(path, &st, &meta);
+    ret = _bosfs_util.get_object_attribute_for_update(path, &st, &meta);
     if (ret != 0) {
         return ret;
     }
@@ -637,11 +775,16 @@ int BosfsImpl::chown(const char *path, uid_t uid, gid_t gid, fuse_file_info *fi)
     if (ret != 0) {
         return ret;
     }
-    _file_manager.del(path);
+    if (S_ISDIR(st.st_mode)) {
+        _bosfs_util.invalidate_access_cache();
+    }
     return 0;
 }
 
 int BosfsImpl::utimens(const char *path, const struct timespec ts[2], fuse_file_info *fi) {
+    if (_file_manager.has_snapshot()) {
+        return -EROFS;
+    }
     std::string realpath;
     if (fi != nullptr) {
         DataCacheEntity *ent = (DataCacheEntity *) fi->fh;
@@ -669,7 +812,7 @@ int BosfsImpl::utimens(const char *path, const struct timespec ts[2], fuse_file_
         return ret;
     }
     ObjectMetaData meta;
-    ret = _bosfs_util.get_object_attribute(path, &st, &meta);
+    ret = _bosfs_util.get_object_attribute_for_update(path, &st, &meta);
     if (ret != 0) {
         return ret;
     }
@@ -689,7 +832,6 @@ int BosfsImpl::utimens(const char *path, const struct timespec ts[2], fuse_file_
     if (ret != 0) {
         return ret;
     }
-    _file_manager.del(path);
     return 0;
 }
 
@@ -708,8 +850,9 @@ int BosfsImpl::getattr(const char *path, struct stat *stbuf, fuse_file_info *fi)
     if (ret != 0) {
         return ret;
     }
-    // check existence
-    ret = _bosfs_util.get_object_attribute(path, stbuf);
+    // check existence, kernel keeps what is returned so an entry from a listing, which
+    // has neither mode nor symlink type, is upgraded first
+    ret = _bosfs_util.get_object_attribute(path, stbuf, NULL, true);
     if (ret != 0) {
         return ret;
     }
@@ -736,6 +879,9 @@ int BosfsImpl::getattr(const char *path, struct stat *stbuf, fuse_file_info *fi)
 }
 
 int BosfsImpl::truncate(const char* path, off_t size, fuse_file_info *fi) {
+    if (_file_manager.has_snapshot()) {
+        return -EROFS;
+    }
 
     std::string realpath;
     if (fi != nullptr) {
@@ -783,7 +929,6 @@ int BosfsImpl::truncate(const char* path, off_t size, fuse_file_info *fi) {
         return ret;
     }
     _data_cache.close_cache(ent);
-    _file_manager.del(path);
     return 0;
 }
 
@@ -886,6 +1031,9 @@ int BosfsImpl::listxattr(const char *path, char *buffer, size_t size) {
 }
 
 int BosfsImpl::removexattr(const char *path, const char *name) {
+    if (_file_manager.has_snapshot()) {
+        return -EROFS;
+    }
     std::string realpath = _bosfs_util.get_real_path(path);
     path = realpath.c_str();
     if (0 == strcmp(path, "/")) {
@@ -902,7 +1050,7 @@ int BosfsImpl::removexattr(const char *path, const char *name) {
         return ret;
     }
     ObjectMetaData meta;
-    ret = _bosfs_util.get_object_attribute(path, &st, &meta);
+    ret = _bosfs_util.get_object_attribute_for_update(path, &st, &meta);
     if (ret != 0) {
         return ret;
     }
@@ -928,11 +1076,13 @@ int BosfsImpl::removexattr(const char *path, const char *name) {
     if (ret != 0) {
         return ret;
     }
-    _file_manager.del(path);
     return 0;
 }
 
 int BosfsImpl::setxattr(const char *path, const char *name, const char *value, size_t size, int flag) {
+    if (_file_manager.has_snapshot()) {
+        return -EROFS;
+    }
     std::string realpath = _bosfs_util.get_real_path(path);
     path = realpath.c_str();
     if (0 == strcmp(path, "/")) {
@@ -950,7 +1100,7 @@ int BosfsImpl::setxattr(const char *path, const char *name, const char *value, s
         return ret;
     }
     ObjectMetaData meta;
-    ret = _bosfs_util.get_object_attribute(path, &st, &meta);
+    ret = _bosfs_util.get_object_attribute_for_update(path, &st, &meta);
     if (ret != 0) {
         return ret;
     }
@@ -997,7 +1147,6 @@ int BosfsImpl::setxattr(const char *path, const char *name, const char *value, s
     if (ret != 0) {
         return ret;
     }
-    _file_manager.del(path);
     return 0;
 }
 
@@ -25,6 +25,8 @@
 #include "sys_util.h"
 #include "data_cache.h"
 #include "file_manager.h"
+#include "meta_warmer.h"
+#include "invalidation_listener.h"
 
 BEGIN_FS_NAMESPACE
 
@@ -34,6 +36,9 @@ public:
     ~BosfsImpl();
 
     int init_bos(BosfsOptions &bosfs_options, std::string &errmsg);
+    int build_snapshot(const std::string &path, std::string &errmsg);
+    int invalidate(const char *path);
+    int invalidate_prefix(const char *path);
 
     DataCache *data_cache();
     FileManager *file_manager();
@@ -79,6 +84,8 @@ private:
     BosfsUtil _bosfs_util;
     FileManager _file_manager;
     DataCache _data_cache;
+    MetaWarmer _meta_warmer;
+    InvalidationListener _invalidation_listener;
 };
 
 END_FS_NAMESPACE
@@ -80,6 +80,18 @@ int Bosfs::init_bos(BosfsOptions &bosfs_options, std::string &errmsg) {
     return _bosfs_impl->init_bos(bosfs_options, errmsg);
 }
 
+int Bosfs::build_snapshot(const std::string &path, std::string &errmsg) {
+    return _bosfs_impl->build_snapshot(path, errmsg);
+}
+
+int Bosfs::invalidate(const char *path) {
+    return _bosfs_impl->invalidate(path);
+}
+
+int Bosfs::invalidate_prefix(const char *path) {
+    return _bosfs_impl->invalidate_prefix(path);
+}
+
 void Bosfs::init(struct fuse_conn_info *conn, fuse_config *cfg) {
     _bosfs_impl->init(conn, cfg);
 }
@@ -340,17 +352,31 @@ static int bosfs_getxattr(const char *path, const char *name, char *value, size_
     return get_bosfs()->getxattr(path, name, value, size);
 }
 
+// Resolve bucket path to bucket name and bucket prefix
+static void split_bucket_path(const std::string &bucket_path, BosfsOptions &bosfs_options) {
+    std::size_t pos = bucket_path.find("/");
+    bosfs_options.bucket = bucket_path.substr(0, pos);
+    if (pos != std::string::npos) {
+        bosfs_options.bucket_prefix = bucket_path.substr(pos+1);
+    }
+}
+
+int bosfs_build_snapshot(
+    const std::string &bucket_path, Bosfs *bosfs, BosfsOptions &bosfs_options,
+    const std::string &snapshot_path, std::string &errmsg) {
+    split_bucket_path(bucket_path, bosfs_options);
+    if (bosfs->init_bos(bosfs_options, errmsg) != 0) {
+        return 3;
+    }
+    return bosfs->build_snapshot(snapshot_path, errmsg);
+}
+
 int bosfs_prepare_fs_operations(
     const std::string &bucket_path, const std::string &mountpoint,
     Bosfs *bosfs, BosfsOptions &bosfs_options,
     struct fuse_operations &bosfs_operation, std::string &errmsg) {
 
-    // Resolve bucket path to bucket name and bucket prefix
-    std::size_t pos = bucket_path.find("/");
-    bosfs_options.bucket = bucket_path.substr(0, pos);   
-    if (pos != std::string::npos) {
-        bosfs_options.bucket_prefix = bucket_path.substr(pos+1);
-    }
+    split_bucket_path(bucket_path, bosfs_options);
 
     // Resolve mountpoint
     char mountpoint_buffer[10240];
@@ -31,8 +31,7 @@ BEGIN_FS_NAMESPACE
 using namespace baidu::bos::cppsdk;
 
 BosfsUtil::BosfsUtil()
-    : _file_manager(nullptr), _data_cache(nullptr) {
-    pthread_mutex_init(&_client_mutex, NULL);
+    : _file_manager(nullptr), _data_cache(nullptr), _fuse(nullptr), _access_generation(0) {
 }
 
 BosfsUtil::~BosfsUtil() {
@@ -59,8 +58,7 @@ void BosfsUtil::set_data_cache(DataCache *data_cache) {
     _data_cache = data_cache;
 }
 
-SharedPtr<Client> BosfsUtil::bos_client() {
-    MutexGuard lock(&_client_mutex);
+RefPtr<Client> BosfsUtil::bos_client() {
     return _bos_client;
 }
 
@@ -103,6 +101,12 @@ int BosfsUtil::_parse_bosfs_options(BosfsOptions &bosfs_options, std::string &er
             return return_with_error_msg(errmsg, "set cache dir %s failed: %d", bosfs_options.cache_dir.c_str(), ret);
         }
     }
+    if (bosfs_options.cache_capacity > 0) {
+        if (bosfs_options.cache_dir.empty()) {
+            return return_with_error_msg(errmsg, "limiting cache capacity requires a cache directory");
+        }
+        _data_cache->set_capacity(bosfs_options.cache_capacity);
+    }
 
     if (bosfs_options.meta_expires_s > 0) {
         _file_manager->set_expire_s(bosfs_options.meta_expires_s);
@@ -111,6 +115,42 @@ int BosfsUtil::_parse_bosfs_options(BosfsOptions &bosfs_options, std::string &er
         bosfs_options.meta_capacity = 100000;
     }
     _file_manager->set_cache_capacity(bosfs_options.meta_capacity);
+    if (bosfs_options.meta_memory_limit > 0) {
+        _file_manager->set_memory_limit(bosfs_options.meta_memory_limit);
+    }
+    if (bosfs_options.meta_negative_expires_s > 0) {
+        _file_manager->set_negative_expire_s(bosfs_options.meta_negative_expires_s);
+        _file_manager->set_negative_capacity(bosfs_options.meta_negative_capacity);
+    }
+    if (bosfs_options.meta_max_stale_s > 0) {
+        _file_manager->set_max_stale_s(bosfs_options.meta_max_stale_s);
+    }
+    if (bosfs_options.meta_dir_expires_s > 0) {
+        _file_manager->set_dir_expire_s(bosfs_options.meta_dir_expires_s);
+    }
+    if (bosfs_options.meta_persist) {
+        if (bosfs_options.cache_dir.empty()) {
+            return return_with_error_msg(errmsg, "persisting meta requires a cache directory");
+        }
+        // keep with /<cache_dir>/.<bucket_name>.stat
+        std::string meta_path = bosfs_options.cache_dir + "/." + bosfs_options.bucket + ".meta";
+        if (bosfs_options.remove_cache) {
+            unlink(meta_path.c_str());
+        }
+        int ret = _file_manager->open_meta_store(meta_path);
+        if (ret != 0) {
+            return return_with_error_msg(errmsg, "open meta store %s failed: %d", meta_path.c_str(), ret);
+        }
+    }
+
+    if (!bosfs_options.snapshot_path.empty()) {
+        const std::string &prefix = bosfs_options.bucket_prefix;
+        std::string root = prefix.empty() ? "/" : "/" + prefix.substr(0, prefix.size() - 1);
+        int ret = _file_manager->open_snapshot(bosfs_options.snapshot_path, root);
+        if (ret != 0) {
+            return return_with_error_msg(errmsg, "open snapshot %s failed: %d", bosfs_options.snapshot_path.c_str(), ret);
+        }
+    }
 
     if (!bosfs_options.storage_class.empty()) {
         if (bosfs_options.storage_class != "STANDARD" && bosfs_options.storage_class != "STANDARD_IA") {
@@ -270,6 +310,13 @@ int BosfsUtil::check_object_access(const char *path, int mask, struct stat *pstb
         return 0;
     }
 
+    // attributes from a listing or a warm up do not tell who owns the object, a
+    // provisional entry is upgraded first
+    ret = get_object_attribute(path, pst, NULL, true);
+    if (ret != 0) {
+        return ret;
+    }
+
     uid_t obj_uid = options().is_bosfs_uid ? options().bosfs_uid : pst->st_uid;
     gid_t obj_gid = options().is_bosfs_gid ? options().bosfs_gid : pst->st_gid;
     mode_t mode;
@@ -312,24 +359,48 @@ int BosfsUtil::check_object_access(const char *path, int mask, struct stat *pstb
 }
 
 int BosfsUtil::get_object_attribute(const std::string &path, struct stat *pstbuf,
-        ObjectMetaData *pmeta) {
+        ObjectMetaData *pmeta, bool need_user_meta) {
     struct stat tmpstbuf;
     struct stat *pst = pstbuf ? pstbuf : &tmpstbuf;
-    init_default_stat(pst);
     if (path == "/" || path == ".") {
+        init_default_stat(pst);
         pst->st_size = ST_BLKSIZE;
         pst->st_blocks = ST_MINBLOCKS;
         return 0;
     }
 
     FilePtr file;
-    int ret = _file_manager->get(path, &file);
+    int ret = _file_manager->get(path, &file, need_user_meta || pmeta != NULL);
     if (ret != 0) {
         return ret;
     }
     if (pmeta != NULL) {
-        *pmeta = file->meta();
+        file->snapshot()->to_meta(pmeta);
+    }
+    if (pstbuf != NULL) {
+        file->stat(pstbuf);
+    }
+    return 0;
+}
+
+int BosfsUtil::get_object_attribute_for_update(const std::string &path, struct stat *pstbuf,
+        ObjectMetaData *meta) {
+    if (path == "/" || path == ".") {
+        return get_object_attribute(path, pstbuf, NULL);
+    }
+    FilePtr file;
+    int ret = _file_manager->get(path, &file, true);
+    if (ret != 0) {
+        return ret;
+    }
+    // a listing or the meta store does not keep every header, the copy would drop them
+    if (file->snapshot()->is_partial()) {
+        ret = _file_manager->upgrade(path, &file);
+        if (ret != 0) {
+            return ret;
+        }
     }
+    file->snapshot()->to_meta(meta);
     if (pstbuf != NULL) {
         file->stat(pstbuf);
     }
@@ -339,17 +410,98 @@ int BosfsUtil::get_object_attribute(const std::string &path, struct stat *pstbuf
 // check each path component has searching permission
 int BosfsUtil::check_path_accessible(const char *path) {
     std::string parent(path);
-    size_t prefix_size = options().bucket_prefix.size();
     size_t pos = parent.rfind('/');
-    while (pos > prefix_size) {
-        parent.resize(pos);
-        int ret = check_object_access(parent.c_str(), X_OK, NULL);
-        if (ret != 0) {
-            return ret;
+    if (pos == std::string::npos || pos <= options().bucket_prefix.size()) {
+        return 0;
+    }
+    struct fuse_context *pctx = this->fuse_get_context();
+    if (pctx == NULL) {
+        return -EIO;
+    }
+    parent.resize(pos);
+    return check_dir_searchable(parent, pctx->uid, pctx->gid);
+}
+
+// verdicts of a whole ancestor chain are kept, so deep paths cost one lookup once warm
+int BosfsUtil::check_dir_searchable(const std::string &dir, uid_t uid, gid_t gid) {
+    AccessKey key = {uid, gid, dir};
+    int64_t now = get_system_time_s();
+    int expire_s = _file_manager->expire_s();
+    uint64_t generation = _access_generation.load();
+    {
+        bcesdk_ns::TLSLockReadGuard lock(_access_lock);
+        AccessCache::iterator it = _access_cache.find(key);
+        if (it != _access_cache.end() && it->second.generation == generation
+                && (expire_s < 0 || it->second.load_time_s + expire_s >= now)) {
+            return it->second.ret;
         }
-        pos = parent.rfind('/');
     }
-    return 0;
+
+    int ret = 0;
+    size_t pos = dir.rfind('/');
+    if (pos != std::string::npos && pos > options().bucket_prefix.size()) {
+        ret = check_dir_searchable(dir.substr(0, pos), uid, gid);
+    }
+    if (ret == 0) {
+        ret = check_object_access(dir.c_str(), X_OK, NULL);
+    }
+    // other errors such as a missing directory are left to file manager
+    if (ret != 0 && ret != -EACCES) {
+        return ret;
+    }
+    bcesdk_ns::TLSLockWriteGuard lock(_access_lock);
+    // a verdict computed before an invalidation must not survive it
+    if (generation != _access_generation.load()) {
+        return ret;
+    }
+    if (_access_cache.size() >= ACCESS_CACHE_CAPACITY) {
+        evict_access_cache(now, expire_s);
+    }
+    AccessVerdict verdict = {ret, now, generation};
+    _access_cache[key] = verdict;
+    return ret;
+}
+
+void BosfsUtil::invalidate_kernel_cache(const std::string &path) {
+    if (_fuse == nullptr) {
+        return;
+    }
+    // reverse of get_real_path, names outside of the mounted prefix are not visible
+    const std::string &prefix = options().bucket_prefix;
+    if (path.size() <= prefix.size() + 1 || path.compare(1, prefix.size(), prefix) != 0) {
+        return;
+    }
+    std::string mount_path = "/" + path.substr(prefix.size() + 1);
+    int ret = fuse_invalidate_path(_fuse, mount_path.c_str());
+    // kernel not knowing the path is fine
+    if (ret != 0 && ret != -ENOENT) {
+        BOSFS_WARN("invalidate kernel cache of %s failed, errno(%d)", mount_path.c_str(), -ret);
+    }
+}
+
+// called with _access_lock held. stale verdicts go first, then arbitrary ones until a
+// quarter of capacity is free, so a full cache is not swept on every miss
+void BosfsUtil::evict_access_cache(int64_t now, int expire_s) {
+    uint64_t generation = _access_generation.load();
+    for (AccessCache::iterator it = _access_cache.begin(); it != _access_cache.end(); ) {
+        if (it->second.generation != generation
+                || (expire_s >= 0 && it->second.load_time_s + expire_s < now)) {
+            it = _access_cache.erase(it);
+        } else {
+            ++it;
+        }
+    }
+    size_t target = ACCESS_CACHE_CAPACITY / 4 * 3;
+    AccessCache::iterator it = _access_cache.begin();
+    while (_access_cache.size() > target && it != _access_cache.end()) {
+        it = _access_cache.erase(it);
+    }
+}
+
+void BosfsUtil::invalidate_access_cache() {
+    bcesdk_ns::TLSLockWriteGuard lock(_access_lock);
+    ++_access_generation;
+    _access_cache.clear();
 }
 
 int BosfsUtil::check_parent_object_access(const char *path, int mask) {
@@ -383,7 +535,7 @@ int BosfsUtil::check_object_owner(const char *path, struct stat *pstbuf)
     int ret = 0;
     struct stat st;
     struct stat *pst = (pstbuf ? pstbuf : &st);
-    if (0 != (ret = get_object_attribute(path, pst))) {
+    if (0 != (ret = get_object_attribute(path, pst, NULL, true))) {
         return ret;
     }
 
@@ -452,8 +604,7 @@ int BosfsUtil::create_bos_client(std::string &errmsg) {
     option.timeout = options().bos_client_timeout;
     option.multi_part_size = options().multipart_size;
     option.max_parallel = options().multipart_parallel;
-    MutexGuard lock(&_client_mutex);
-    _bos_client.reset(new Client(Credential(options().ak, options().sk, options().sts_token), option));
+    _bos_client = make_ref<Client>(Credential(options().ak, options().sk, options().sts_token), option);
     return BOSFS_OK;
 }
 
@@ -600,6 +751,9 @@ int BosfsUtil::head_object(const std::string &object, ObjectMetaData *meta, bool
 
 int BosfsUtil::multiple_head_object(std::vector<std::string> &objects,
         std::vector<struct stat *> &stats) {
+    if (objects.empty()) {
+        return 0;
+    }
     std::vector<BceRequestContext> ctx(objects.size());
     for (size_t i = 0; i < objects.size(); ++i) {
         ctx[i].request = new HeadObjectRequest(options().bucket, objects[i]);
@@ -631,8 +785,8 @@ int BosfsUtil::multiple_head_object(std::vector<std::string> &objects,
             } else {
                 path += objects[i];
             }
-            FilePtr file(new File(this, path));
-            file->meta().move_from(res->meta());
+            FilePtr file = make_ref<File>(this, path);
+            file->set_meta(res->meta());
             file->set_is_dir_obj(is_dir_obj);
             file->stat(stats[i]);
             _file_manager->set(path, file);
@@ -641,9 +795,65 @@ int BosfsUtil::multiple_head_object(std::vector<std::string> &objects,
     return 0;
 }
 
+int BosfsUtil::multiple_head_stat(const std::vector<std::string> &objects,
+        std::vector<struct stat> *stats, std::vector<bool> *exists) {
+    stats->clear();
+    stats->resize(objects.size());
+    exists->assign(objects.size(), false);
+    if (objects.empty()) {
+        return 0;
+    }
+    std::vector<BceRequestContext> ctx(objects.size());
+    for (size_t i = 0; i < objects.size(); ++i) {
+        ctx[i].request = new HeadObjectRequest(options().bucket, objects[i]);
+        ctx[i].response = new HeadObjectResponse();
+        ctx[i].is_own = true;
+    }
+    int ret = bos_client()->send_request(ctx.size(), &ctx.front(), 100);
+    if (ret != 0) {
+        return ret;
+    }
+    for (size_t i = 0; i < objects.size(); ++i) {
+        HeadObjectResponse *res = (HeadObjectResponse *) ctx[i].response;
+        if (res->is_fail()) {
+            // deleted since it was listed
+            if (res->status_code() == 404) {
+                continue;
+            }
+            BOSFS_WARN("head object(%s) failed, bos service error: %s", objects[i].c_str(),
+                    res->error().message().c_str());
+            return BOSFS_BOS_SERVICE_ERROR;
+        }
+        // parsed the way a cached file would be, but left out of the file manager
+        FilePtr file = make_ref<File>(this, object_to_path(objects[i]));
+        file->set_meta(res->meta());
+        file->set_is_dir_obj(*objects[i].rbegin() == '/');
+        file->stat(&(*stats)[i]);
+        (*exists)[i] = true;
+    }
+    return 0;
+}
+
 int BosfsUtil::list_objects(const std::string &prefix, int max_keys, std::string &marker,
         const char *delimiter, std::vector<std::string> *items,
         std::vector<std::string> *common_prefix) {
+    std::vector<ObjectSummary> objects;
+    if (common_prefix == NULL) {
+        common_prefix = items;
+    }
+    int ret = list_objects(prefix, max_keys, marker, delimiter, &objects, common_prefix);
+    if (ret != 0) {
+        return ret;
+    }
+    for (size_t i = 0; i < objects.size(); ++i) {
+        items->push_back(objects[i].key);
+    }
+    return 0;
+}
+
+int BosfsUtil::list_objects(const std::string &prefix, int max_keys, std::string &marker,
+        const char *delimiter, std::vector<ObjectSummary> *items,
+        std::vector<std::string> *common_prefix) {
     ListObjectsRequest request(options().bucket);
     if (max_keys >= 0 && max_keys < 1000) {
         request.set_max_keys(max_keys);
@@ -659,9 +869,6 @@ int BosfsUtil::list_objects(const std::string &prefix, int max_keys, std::string
 
     bool has_next = true;
     int n = 0;
-    if (common_prefix == NULL) {
-        common_prefix = items;
-    }
     while (has_next && (max_keys <= 0 || n < max_keys)) {
         request.set_marker(marker);
         if (max_keys - n < 1000) {
@@ -683,13 +890,13 @@ int BosfsUtil::list_objects(const std::string &prefix, int max_keys, std::string
         const std::vector<ObjectSummary> &objects = response.contents();
         if (objects.size() > 0) {
             if (objects[0].key != prefix) {
-                items->push_back(objects[0].key);
+                items->push_back(objects[0]);
                 n += objects.size();
             } else {
                 n += objects.size() - 1;
             }
             for (size_t i = 1; i < objects.size(); ++i) {
-                items->push_back(objects[i].key);
+                items->push_back(objects[i]);
             }
         }
         marker = response.next_marker();
@@ -745,6 +952,9 @@ int BosfsUtil::create_object(const char *path, mode_t mode, uid_t uid, gid_t gid
                 path, response.error().message().c_str(), ret);
         return BOSFS_BOS_CLIENT_REQUEST_ERROR;
     }
+    meta.set_content_length(data.size());
+    meta.set_etag(response.etag());
+    cache_written_meta(path, meta, S_ISDIR(mode), true);
     return BOSFS_OK;
 }
 
@@ -774,40 +984,89 @@ int BosfsUtil::delete_object(const std::string &object, std::string *version)
 }
 
 int BosfsUtil::change_object_meta(const std::string &object, ObjectMetaData &meta) {
-    int ret = bos_client()->copy_object(options().bucket, object, options().bucket, object, "", &meta);
-    if (ret == RET_KEY_NOT_EXIST) {
-        //retry for 5 times, in case that object have not been flushed to bos
-        for (int i = 0; i < 5; ++i) {
-            ret = bos_client()->copy_object(options().bucket, object, options().bucket, object, "", &meta);
-            if (ret == 0) {
-                return 0; 
-            }
-            ::sleep(1);
+    CopyObjectRequest request(options().bucket, object, options().bucket, object);
+    request.set_meta(&meta);
+    std::string etag;
+    time_t last_modified = 0;
+    //retry for 5 times, in case that object have not been flushed to bos
+    for (int i = 0; ; ++i) {
+        CopyObjectResponse response;
+        int ret = bos_client()->copy_object(request, &response);
+        if (ret == 0 && !response.is_fail()) {
+            etag = response.etag();
+            last_modified = response.last_modified();
+            break;
         }
-        return -ENOENT;
-    } else if (ret != 0) {
-        return -EIO;
-    }
+        if (ret != 0 || response.status_code() != 404) {
+            BOSFS_ERR("copy object(%s) onto itself failed: %s, bos client errno: %d",
+                    object.c_str(), response.error().message().c_str(), ret);
+            return -EIO;
+        }
+        if (i == 5) {
+            return -ENOENT;
+        }
+        ::sleep(1);
+    }
+    // copying onto itself keeps the content, so size stays valid and so do local data
+    // of the version copied
+    std::string path = object_to_path(object);
+    std::string old_etag = meta.etag();
+    meta.set_etag(etag);
+    meta.set_last_modified(last_modified);
+    _data_cache->rebase_version(path.c_str(), old_etag, meta.etag(), meta.last_modified());
+    cache_written_meta(path, meta, *object.rbegin() == '/');
     return 0;
 }
 
+void BosfsUtil::cache_written_meta(const std::string &path, ObjectMetaData &meta,
+        bool is_dir_obj, bool created) {
+    FilePtr file = make_ref<File>(this, path);
+    // without a last modified time of bos the snapshot is partial, it is filled in by a
+    // HEAD once a caller needs it
+    file->set_meta(meta, meta.last_modified() == 0);
+    file->set_is_dir_obj(is_dir_obj);
+    _file_manager->set(path, file, created);
+}
+
 int BosfsUtil::rename_file(const std::string &src, const std::string &dst, int64_t size_hint) {
     BOSFS_INFO("copy object request from: %s to: %s", src.c_str(), dst.c_str());
     int ret = 0;
-    if (size_hint < 0 || size_hint >= options().multipart_threshold) {
+    bool is_multipart = size_hint < 0 || size_hint >= options().multipart_threshold;
+    CopyObjectResponse response;
+    if (is_multipart) {
         ret = bos_client()->parallel_copy(options().bucket, src, options().bucket, dst, options().storage_class);
     } else {
-        ret = bos_client()->copy_object(options().bucket, src, options().bucket, dst, options().storage_class);
+        CopyObjectRequest request(options().bucket, dst, options().bucket, src);
+        request.set_storage_class(options().storage_class);
+        ret = bos_client()->copy_object(request, &response);
+        if (ret == 0 && response.is_fail()) {
+            BOSFS_ERR("copy object(%s) to %s failed: %s", src.c_str(), dst.c_str(),
+                    response.error().message().c_str());
+            ret = response.status_code() == 404 ? RET_KEY_NOT_EXIST : RET_SERVICE_ERROR;
+        }
     }
     if (ret != 0) {
-        _file_manager->del("/" + src.substr(0, src.size()-1));
-        _file_manager->del("/" + dst.substr(0, dst.size()-1));
+        _file_manager->del(object_to_path(src));
+        _file_manager->del(object_to_path(dst));
         return ret;
     }
     delete_object(src);
 
-    _file_manager->del("/" + src.substr(0, src.size()-1));
-    _file_manager->del("/" + dst.substr(0, dst.size()-1));
+    // copy keeps the meta, so what is known of src is moved to dst. a multipart copy
+    // does not tell the etag it ends with, dst is then left to a HEAD
+    FilePtr file;
+    bool known = _file_manager->try_get(object_to_path(src), &file)
+        && !file->snapshot()->is_partial();
+    _file_manager->del(object_to_path(src));
+    if (!known || is_multipart) {
+        _file_manager->del(object_to_path(dst));
+        return 0;
+    }
+    ObjectMetaData meta;
+    file->snapshot()->to_meta(&meta);
+    meta.set_etag(response.etag());
+    meta.set_last_modified(response.last_modified());
+    cache_written_meta(object_to_path(dst), meta, false, true);
     return 0;
 }
 
@@ -839,7 +1098,6 @@ int BosfsUtil::rename_directory(const std::string &src, const std::string &dst)
             break;
         }
         dst_items.push_back(dst_object);
-        _file_manager->del("/" + dst_object);
     }
     if (dst_items.size() != items.size()) {
         ret = RET_SERVICE_ERROR;
@@ -849,14 +1107,16 @@ int BosfsUtil::rename_directory(const std::string &src, const std::string &dst)
     if (ret != 0 && ret != RET_KEY_NOT_EXIST) {
         for (size_t i = 0; i < dst_items.size(); ++i) {
             delete_object(dst_items[i]);
-            _file_manager->del("/" + dst_items[i]);
         }
+        _file_manager->del_subtree(object_to_path(dst_prefix));
         return BOSFS_BOS_SERVICE_ERROR;
     }
     for (size_t i = 0; i < items.size(); ++i) {
         delete_object(items[i]);
-        _file_manager->del("/" + items[i]);
     }
+    // also forgets nonexistent names, implicit directories under dst may be among them
+    _file_manager->del_subtree(object_to_path(prefix));
+    _file_manager->del_subtree(object_to_path(dst_prefix));
     return 0;
 }
 
@@ -14,17 +14,21 @@
 #include <string.h>
 #include <time.h>
 
+#include <atomic>
 #include <string>
 #include <map>
+#include <unordered_map>
 
 #include "common.h"
 #include "util.h"
 #include "data_cache.h"
 #include "bcesdk/bos/client.h"
+#include "bcesdk/util/lock.h"
 
 BEGIN_FS_NAMESPACE
 
 using baidu::bos::cppsdk::ObjectMetaData;
+using baidu::bos::cppsdk::ObjectSummary;
 
 class DataCacheEntity;
 
@@ -55,7 +59,8 @@ public:
         return _bosfs_options;
     }
 
-    SharedPtr<baidu::bos::cppsdk::Client> bos_client();
+    // client is only replaced in init_bos() before any request is served
+    RefPtr<baidu::bos::cppsdk::Client> bos_client();
     int init_bos(BosfsOptions &bosfs_options, std::string &errmsg);
 
     std::string object_to_path(const std::string &object);
@@ -63,9 +68,23 @@ public:
     std::string get_real_path(const char*);
 
     int check_object_access(const char *path, int mask, struct stat *pstbuf);
+    // need_user_meta makes sure uid/gid/mode come from user meta rather than a listing,
+    // which is implied if pmeta is given
     int get_object_attribute(const std::string &path, struct stat *pstbuf,
-            ObjectMetaData *pmeta = NULL);
+            ObjectMetaData *pmeta = NULL, bool need_user_meta = false);
+    // meta to be changed and written back to bos, served from cache unless the cached
+    // snapshot is partial, in which case it is replaced by one HEAD
+    int get_object_attribute_for_update(const std::string &path, struct stat *pstbuf,
+            ObjectMetaData *meta);
     int check_path_accessible(const char *path);
+    // fuse to notify when kernel caches entries and attributes, NULL if it does not
+    void set_fuse(struct fuse *fuse) { _fuse = fuse; }
+    // drop kernel entry and attributes of a real path, never call it from inside a
+    // fuse operation
+    void invalidate_kernel_cache(const std::string &path);
+    // forget cached search permission verdicts, must be called once mode or owner of a
+    // directory changes or a directory goes away
+    void invalidate_access_cache();
     int check_parent_object_access(const char *path, int mask);
     int check_object_owner(const char *path, struct stat *pstbuf);
     DataCacheEntity *get_local_entity(const char *path, bool is_load=false);
@@ -74,6 +93,10 @@ public:
             bool *is_prefix);
     int multiple_head_object(std::vector<std::string> &objects,
             std::vector<struct stat *> &stats);
+    // stat of each object without caching it, exists[i] is false if object i is gone.
+    // any other failure fails them all rather than leaving a default stat
+    int multiple_head_stat(const std::vector<std::string> &objects,
+            std::vector<struct stat> *stats, std::vector<bool> *exists);
 
     int list_subitems(const std::string &prefix, int max_keys, 
             std::vector<std::string> *items) {
@@ -84,6 +107,10 @@ public:
     int list_objects(const std::string &prefix, int max_keys, std::string &marker,
             const char *delimiter, std::vector<std::string> *items,
             std::vector<std::string> *common_prefix = NULL);
+    // same as above but keeps size, etag and last modified time of objects
+    int list_objects(const std::string &prefix, int max_keys, std::string &marker,
+            const char *delimiter, std::vector<ObjectSummary> *items,
+            std::vector<std::string> *common_prefix);
 
     void create_meta(const std::string &object_name, mode_t mode, uid_t uid, gid_t gid,
             ObjectMetaData *meta);
@@ -95,7 +122,14 @@ public:
     int rename_file(const std::string &path, const std::string &dst, int64_t size_hint = -1);
     int rename_directory(const std::string &src, const std::string &dst);
 
+    // replace meta of object by a copy onto itself, etag and last modified time of the
+    // copy are set to meta
     int change_object_meta(const std::string &object, ObjectMetaData &meta);
+    // cache meta just written to path, so the getattr following every change needs no
+    // HEAD. meta without last modified time of bos is cached as a partial snapshot,
+    // created is as FileManager::set()
+    void cache_written_meta(const std::string &path, ObjectMetaData &meta, bool is_dir_obj,
+            bool created = false);
 
     void init_default_stat(struct stat *pst);
 
@@ -108,11 +142,41 @@ protected:
     int check_bucket_access();
 
 private:
+    enum { ACCESS_CACHE_CAPACITY = 65536 };
+    // search permission of dir and all its ancestors as seen by uid/gid
+    struct AccessKey {
+        uid_t uid;
+        gid_t gid;
+        std::string dir;
+
+        bool operator==(const AccessKey &other) const {
+            return uid == other.uid && gid == other.gid && dir == other.dir;
+        }
+    };
+    struct AccessKeyHash {
+        size_t operator()(const AccessKey &key) const {
+            return std::hash<std::string>()(key.dir) ^ ((size_t) key.uid << 16) ^ key.gid;
+        }
+    };
+    struct AccessVerdict {
+        int ret;
+        int64_t load_time_s;
+        uint64_t generation;
+    };
+    typedef std::unordered_map<AccessKey, AccessVerdict, AccessKeyHash> AccessCache;
+
+    int check_dir_searchable(const std::string &dir, uid_t uid, gid_t gid);
+    void evict_access_cache(int64_t now, int expire_s);
+
+
     BosfsOptions _bosfs_options;
-    SharedPtr<baidu::bos::cppsdk::Client> _bos_client;
-    pthread_mutex_t _client_mutex;
+    RefPtr<baidu::bos::cppsdk::Client> _bos_client;
     FileManager *_file_manager;
     DataCache *_data_cache;
+    struct fuse *_fuse;
+    AccessCache _access_cache;
+    bcesdk_ns::TLSLock _access_lock;
+    std::atomic<uint64_t> _access_generation;
 };
 
 END_FS_NAMESPACE
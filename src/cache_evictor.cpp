@@ -0,0 +1,311 @@
+/**
+ * bosfs - A fuse-based file system implemented on Baidu Object Storage(BOS)
+ *
+ * Copyright (c) 2016 Baidu.com, Inc. All rights reserved.
+ *
+ * @file    cache_evictor.cpp
+ * @brief   keeps cache dir within a byte capacity by evicting cold cache files
+ **/
+#include <errno.h>
+#include <dirent.h>
+#include <string.h>
+#include <time.h>
+#include <sys/stat.h>
+
+#include <algorithm>
+
+#include "bosfs_lib/bosfs_lib.h"
+#include "cache_evictor.h"
+#include "data_cache.h"
+#include "util.h"
+
+BEGIN_FS_NAMESPACE
+
+CacheEvictor::CacheEvictor(DataCache *data_cache)
+    : _data_cache(data_cache), _capacity(0), _running(false), _started(false),
+      _bytes(0), _protected_bytes(0), _evicted_files(0), _evicted_bytes(0),
+      _skipped_open(0) {
+    pthread_mutex_init(&_mutex, NULL);
+    pthread_cond_init(&_cond, NULL);
+}
+
+CacheEvictor::~CacheEvictor() {
+    stop();
+    pthread_cond_destroy(&_cond);
+    pthread_mutex_destroy(&_mutex);
+}
+
+int CacheEvictor::start() {
+    MutexGuard lock(&_mutex);
+    if (_started || _capacity <= 0) {
+        return 0;
+    }
+    _running = true;
+    int ret = pthread_create(&_thread, NULL, evict_thread, this);
+    if (ret != 0) {
+        BOSFS_ERR("failed to start cache eviction thread, errno: %d", ret);
+        _running = false;
+        return -ret;
+    }
+    _started = true;
+    return 0;
+}
+
+void CacheEvictor::stop() {
+    {
+        MutexGuard lock(&_mutex);
+        if (!_started) {
+            return;
+        }
+        _running = false;
+        _started = false;
+        pthread_cond_broadcast(&_cond);
+    }
+    pthread_join(_thread, NULL);
+}
+
+void CacheEvictor::touch(const std::string &path) {
+    MutexGuard lock(&_mutex);
+    EntryMap::iterator it = _entries.find(path);
+    if (it == _entries.end()) {
+        Entry entry = {path, 0, false};
+        _probation.push_front(entry);
+        _entries[path] = _probation.begin();
+        return;
+    }
+    Entry &entry = *it->second;
+    if (entry.is_protected) {
+        _protected.splice(_protected.begin(), _protected, it->second);
+        return;
+    }
+    entry.is_protected = true;
+    _protected_bytes += entry.bytes;
+    _protected.splice(_protected.begin(), _probation, it->second);
+    balance();
+}
+
+void CacheEvictor::update(const std::string &path, int64_t bytes) {
+    MutexGuard lock(&_mutex);
+    EntryMap::iterator it = _entries.find(path);
+    if (it == _entries.end()) {
+        Entry entry = {path, 0, false};
+        _probation.push_front(entry);
+        it = _entries.insert(std::make_pair(path, _probation.begin())).first;
+    }
+    Entry &entry = *it->second;
+    _bytes += bytes - entry.bytes;
+    if (entry.is_protected) {
+        _protected_bytes += bytes - entry.bytes;
+    }
+    entry.bytes = bytes;
+    if (entry.is_protected) {
+        balance();
+    }
+    if (_capacity > 0 && _bytes > _capacity) {
+        pthread_cond_signal(&_cond);
+    }
+}
+
+void CacheEvictor::remove(const std::string &path) {
+    MutexGuard lock(&_mutex);
+    EntryMap::iterator it = _entries.find(path);
+    if (it != _entries.end()) {
+        unlink_entry(it);
+    }
+}
+
+int64_t CacheEvictor::bytes_except(const std::string &path) {
+    MutexGuard lock(&_mutex);
+    EntryMap::iterator it = _entries.find(path);
+    return it == _entries.end() ? _bytes : _bytes - it->second->bytes;
+}
+
+void CacheEvictor::stats(CacheEvictorStats *stats) {
+    MutexGuard lock(&_mutex);
+    stats->files = _entries.size();
+    stats->bytes = _bytes;
+    stats->capacity = _capacity;
+    stats->protected_files = _protected.size();
+    stats->protected_bytes = _protected_bytes;
+    stats->evicted_files = _evicted_files;
+    stats->evicted_bytes = _evicted_bytes;
+    stats->skipped_open = _skipped_open;
+}
+
+void *CacheEvictor::evict_thread(void *arg) {
+    reinterpret_cast<CacheEvictor *>(arg)->evict_loop();
+    return NULL;
+}
+
+void CacheEvictor::evict_loop() {
+    std::string top_dir;
+    if (_data_cache->make_cache_path(NULL, top_dir, false)) {
+        std::vector<ScannedFile> files;
+        scan("", top_dir, &files);
+        add_scanned(files);
+        BOSFS_INFO("indexed %zu cache files in %s", files.size(), top_dir.c_str());
+    }
+    pthread_mutex_lock(&_mutex);
+    while (_running) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        if (_bytes <= _capacity) {
+            deadline.tv_sec += EVICT_INTERVAL_S;
+            pthread_cond_timedwait(&_cond, &_mutex, &deadline);
+            continue;
+        }
+        pthread_mutex_unlock(&_mutex);
+        uint64_t evicted = evict();
+        pthread_mutex_lock(&_mutex);
+        // what is left over is open, do not spin on it until some is closed
+        if (_running && evicted == 0) {
+            deadline.tv_sec += 1;
+            pthread_cond_timedwait(&_cond, &_mutex, &deadline);
+        }
+    }
+    pthread_mutex_unlock(&_mutex);
+}
+
+void CacheEvictor::scan(const std::string &path, const std::string &dir,
+        std::vector<ScannedFile> *files) {
+    DIR *pdir = opendir(dir.c_str());
+    if (pdir == NULL) {
+        return;
+    }
+    for (struct dirent *dent = readdir(pdir); dent && _running; dent = readdir(pdir)) {
+        if (0 == strcmp(dent->d_name, "..") || 0 == strcmp(dent->d_name, ".")) {
+            continue;
+        }
+        std::string child = path + "/" + dent->d_name;
+        std::string child_cache = dir + "/" + dent->d_name;
+        struct stat st;
+        if (0 != lstat(child_cache.c_str(), &st)) {
+            continue;
+        }
+        if (S_ISDIR(st.st_mode)) {
+            scan(child, child_cache, files);
+        } else if (S_ISREG(st.st_mode)) {
+            ScannedFile file = {std::max(st.st_atime, st.st_mtime), child,
+                static_cast<int64_t>(st.st_blocks) * 512};
+            files->push_back(file);
+        }
+    }
+    closedir(pdir);
+}
+
+void CacheEvictor::add_scanned(std::vector<ScannedFile> &files) {
+    std::sort(files.begin(), files.end());
+    MutexGuard lock(&_mutex);
+    for (size_t i = 0; i < files.size(); ++i) {
+        if (_entries.find(files[i].path) != _entries.end()) {
+            continue;
+        }
+        Entry entry = {files[i].path, files[i].bytes, false};
+        _probation.push_front(entry);
+        _entries[files[i].path] = _probation.begin();
+        _bytes += files[i].bytes;
+    }
+}
+
+uint64_t CacheEvictor::evict() {
+    // pick victims coldest first, deleting them takes the lock of data cache which is
+    // held while calling us, so it is done with _mutex released
+    VictimList victims;
+    {
+        MutexGuard lock(&_mutex);
+        pick_victims(_bytes - _capacity / 100 * LOW_WATERMARK_PERCENT, "", &victims);
+    }
+    int64_t freed = 0;
+    uint64_t evicted_files = evict_victims(victims, true, &freed);
+    MutexGuard lock(&_mutex);
+    BOSFS_INFO("evicted %llu of %zu picked cache files of %lld bytes, %lld of %lld bytes "
+            "cached", (unsigned long long) evicted_files, victims.size(), (long long) freed,
+            (long long) _bytes, (long long) _capacity);
+    return evicted_files;
+}
+
+int64_t CacheEvictor::free_space(int64_t bytes, const std::string &path) {
+    VictimList victims;
+    {
+        MutexGuard lock(&_mutex);
+        pick_victims(bytes, path, &victims);
+    }
+    int64_t freed = 0;
+    uint64_t evicted_files = evict_victims(victims, false, &freed);
+    BOSFS_DEBUG("evicted %llu cache files of %lld bytes to read %s",
+            (unsigned long long) evicted_files, (long long) freed, path.c_str());
+    return freed;
+}
+
+void CacheEvictor::pick_victims(int64_t bytes, const std::string &path,
+        VictimList *victims) {
+    EntryList *segments[] = {&_probation, &_protected};
+    for (int i = 0; i < 2 && bytes > 0; ++i) {
+        for (EntryList::reverse_iterator it = segments[i]->rbegin();
+                it != segments[i]->rend() && bytes > 0; ++it) {
+            if (it->path == path) {
+                continue;
+            }
+            victims->push_back(std::make_pair(it->path, it->bytes));
+            bytes -= it->bytes;
+        }
+    }
+}
+
+uint64_t CacheEvictor::evict_victims(const VictimList &victims, bool in_background,
+        int64_t *freed) {
+    uint64_t evicted_files = 0;
+    uint64_t evicted_bytes = 0;
+    uint64_t skipped_open = 0;
+    for (size_t i = 0; i < victims.size() && (!in_background || _running); ++i) {
+        int ret = _data_cache->evict(victims[i].first, in_background);
+        if (ret == 0) {
+            ++evicted_files;
+            evicted_bytes += victims[i].second;
+        } else if (ret == -EBUSY) {
+            // in use right now, so it is as recent as it gets
+            requeue(victims[i].first);
+            ++skipped_open;
+        }
+    }
+    *freed = evicted_bytes;
+    MutexGuard lock(&_mutex);
+    _evicted_files += evicted_files;
+    _evicted_bytes += evicted_bytes;
+    _skipped_open += skipped_open;
+    return evicted_files;
+}
+
+void CacheEvictor::requeue(const std::string &path) {
+    MutexGuard lock(&_mutex);
+    EntryMap::iterator it = _entries.find(path);
+    if (it == _entries.end()) {
+        return;
+    }
+    EntryList &segment = it->second->is_protected ? _protected : _probation;
+    segment.splice(segment.begin(), segment, it->second);
+}
+
+void CacheEvictor::balance() {
+    int64_t limit = _capacity / 100 * PROTECTED_PERCENT;
+    while (_capacity > 0 && _protected_bytes > limit && _protected.size() > 1) {
+        EntryList::iterator last = --_protected.end();
+        last->is_protected = false;
+        _protected_bytes -= last->bytes;
+        _probation.splice(_probation.begin(), _protected, last);
+    }
+}
+
+void CacheEvictor::unlink_entry(EntryMap::iterator it) {
+    EntryList::iterator entry = it->second;
+    _bytes -= entry->bytes;
+    if (entry->is_protected) {
+        _protected_bytes -= entry->bytes;
+        _protected.erase(entry);
+    } else {
+        _probation.erase(entry);
+    }
+    _entries.erase(it);
+}
+
+END_FS_NAMESPACE
@@ -0,0 +1,137 @@
+/**
+ * bosfs - A fuse-based file system implemented on Baidu Object Storage(BOS)
+ *
+ * Copyright (c) 2016 Baidu.com, Inc. All rights reserved.
+ *
+ * @file    cache_evictor.h
+ * @brief   keeps cache dir within a byte capacity by evicting cold cache files
+ **/
+#ifndef BAIDU_BOS_BOSFS_CACHE_EVICTOR_H
+#define BAIDU_BOS_BOSFS_CACHE_EVICTOR_H
+
+#include <stdint.h>
+#include <pthread.h>
+
+#include <atomic>
+#include <list>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "common.h"
+
+BEGIN_FS_NAMESPACE
+
+class DataCache;
+
+struct CacheEvictorStats {
+    CacheEvictorStats() : files(0), bytes(0), capacity(0), protected_files(0),
+        protected_bytes(0), evicted_files(0), evicted_bytes(0), skipped_open(0) {}
+    size_t files;
+    int64_t bytes;              // allocated on disk by indexed cache files
+    int64_t capacity;
+    size_t protected_files;
+    int64_t protected_bytes;
+    uint64_t evicted_files;
+    uint64_t evicted_bytes;
+    uint64_t skipped_open;      // victims left alone because they were open
+};
+
+// segmented LRU of cache files. a file opened for the first time enters the probation
+// segment and moves to the protected one when it is opened again, protected files
+// beyond their share of capacity fall back to probation. victims are taken from
+// probation first, so files read once, however large or many, leave before the hot set.
+// sizes are taken when files are closed, eviction runs in background once capacity is
+// exceeded and goes down to a low watermark
+class CacheEvictor {
+public:
+    explicit CacheEvictor(DataCache *data_cache);
+    ~CacheEvictor();
+
+    // bytes of cache dir to keep, 0 for no limit
+    void set_capacity(int64_t capacity) { _capacity = capacity; }
+    int64_t capacity() const { return _capacity; }
+
+    // index cache files left by previous mounts and start evicting. must be called
+    // after fuse daemonized, threads do not survive fork()
+    int start();
+    void stop();
+
+    // path is opened
+    void touch(const std::string &path);
+    // cache file of path is closed with bytes allocated on disk
+    void update(const std::string &path, int64_t bytes);
+    // cache file of path is deleted
+    void remove(const std::string &path);
+
+    // bytes of all indexed cache files but path, which may be open and growing
+    int64_t bytes_except(const std::string &path);
+    // evict cold files other than path right away until bytes are freed, return bytes
+    // freed. called by a reader of path holding its entity lock, so files whose removal
+    // would have to wait for the lock of data cache are skipped
+    int64_t free_space(int64_t bytes, const std::string &path);
+    void stats(CacheEvictorStats *stats);
+
+private:
+    enum {
+        PROTECTED_PERCENT = 80,
+        LOW_WATERMARK_PERCENT = 90,
+        EVICT_INTERVAL_S = 10
+    };
+    struct Entry {
+        std::string path;
+        int64_t bytes;
+        bool is_protected;
+    };
+    typedef std::list<Entry> EntryList;
+    typedef std::unordered_map<std::string, EntryList::iterator> EntryMap;
+    struct ScannedFile {
+        time_t atime;
+        std::string path;
+        int64_t bytes;
+        bool operator<(const ScannedFile &other) const { return atime < other.atime; }
+    };
+
+    static void *evict_thread(void *arg);
+    void evict_loop();
+    void scan(const std::string &path, const std::string &dir,
+            std::vector<ScannedFile> *files);
+    // insert files found on disk unless they are indexed already, oldest is coldest
+    void add_scanned(std::vector<ScannedFile> &files);
+    typedef std::vector<std::pair<std::string, int64_t> > VictimList;
+
+    // one round down to low watermark, return how many files were evicted
+    uint64_t evict();
+    // coldest files worth bytes but path, called with _mutex held
+    void pick_victims(int64_t bytes, const std::string &path, VictimList *victims);
+    // evict victims, an open one is requeued. in background the lock of data cache is
+    // waited for and shutdown is noticed. return how many files were evicted
+    uint64_t evict_victims(const VictimList &victims, bool in_background, int64_t *freed);
+    // move path to the head of its segment
+    void requeue(const std::string &path);
+    // move protected files beyond their share to probation, called with _mutex held
+    void balance();
+    void unlink_entry(EntryMap::iterator it);
+
+    DataCache *_data_cache;
+    int64_t _capacity;
+    pthread_mutex_t _mutex;
+    pthread_cond_t _cond;
+    std::atomic<bool> _running;
+    bool _started;
+    pthread_t _thread;
+
+    // most recent first
+    EntryList _probation;
+    EntryList _protected;
+    EntryMap _entries;
+    int64_t _bytes;
+    int64_t _protected_bytes;
+    uint64_t _evicted_files;
+    uint64_t _evicted_bytes;
+    uint64_t _skipped_open;
+};
+
+END_FS_NAMESPACE
+
+#endif
@@ -8,7 +8,7 @@
  * @date    2016.9
  **/
 #include <stdlib.h>
-#include <sys/file.h>
+#include <fcntl.h>
 #include <sys/time.h>
 #include <utime.h>
 #include <dirent.h>
@@ -38,12 +38,14 @@ BEGIN_FS_NAMESPACE
 // Definition of class ObjectPageList
 void ObjectPageList::free_list(self_type &lst)
 {
-    for (self_type::iterator iter = lst.begin(); iter != lst.end(); iter = lst.erase(iter)) {
-        delete *iter;
-    }
     lst.clear();
 }
 
+static bool offset_less(off_t pos, const ObjectPage &page)
+{
+    return pos < page.get_offset();
+}
+
 ObjectPageList::ObjectPageList(size_t size, bool loaded)
 {
     init(size, loaded);
@@ -57,8 +59,7 @@ ObjectPageList::~ObjectPageList()
 bool ObjectPageList::init(size_t size, bool loaded)
 {
     clear();
-    ObjectPage *page = new ObjectPage(0, size, loaded);
-    _pages.push_back(page);
+    _pages.push_back(ObjectPage(0, size, loaded));
     return true;
 }
 
@@ -67,8 +68,7 @@ size_t ObjectPageList::get_size() const
     if (_pages.empty()) {
         return 0;
     }
-    self_type::const_reverse_iterator rite = _pages.rbegin();
-    return static_cast<size_t>((*rite)->next());
+    return static_cast<size_t>(_pages.back().next());
 }
 
 bool ObjectPageList::resize(size_t size, bool loaded)
@@ -78,36 +78,26 @@ bool ObjectPageList::resize(size_t size, bool loaded)
     if (0 == total) {
         init(size, loaded);
     } else if (total < size) {
-        ObjectPage *page = new ObjectPage(static_cast<off_t>(total), (size - total), loaded);
-        _pages.push_back(page);
+        _pages.push_back(ObjectPage(static_cast<off_t>(total), (size - total), loaded));
+        compress(_pages.size() - 1);
+    } else if (0 == size) {
+        clear();
     } else if (size < total) {
-        for (self_type::iterator iter = _pages.begin(); iter != _pages.end();) {
-            if (static_cast<size_t>((*iter)->next()) <= size) {
-                ++iter;
-            } else {
-                if (size <= static_cast<size_t>((*iter)->get_offset())) {
-                    delete *iter;
-                    iter = _pages.erase(iter);
-                } else {
-                    (*iter)->set_bytes(size - static_cast<size_t>((*iter)->get_offset()));
-                }
-            }
-        }
+        size_t index = find_page(static_cast<off_t>(size - 1));
+        _pages.erase(_pages.begin() + index + 1, _pages.end());
+        _pages[index].set_bytes(size - static_cast<size_t>(_pages[index].get_offset()));
     }
-    return compress();
+    return true;
 }
 
 bool ObjectPageList::is_page_loaded(off_t start, size_t size) const
 {
-    for (self_type::const_iterator ite = _pages.begin(); ite != _pages.end(); ++ite) {
-        if ((*ite)->end() < start) {
-            continue;
-        }
-        if (!(*ite)->get_loaded()) {
+    for (size_t i = find_page(start); i < _pages.size(); ++i) {
+        if (!_pages[i].get_loaded()) {
             return false;
         }
         if (0 != size && static_cast<size_t>(start + size) <=
-                static_cast<size_t>((*ite)->next())) {
+                static_cast<size_t>(_pages[i].next())) {
             break;
         }
     }
@@ -116,42 +106,31 @@ bool ObjectPageList::is_page_loaded(off_t start, size_t size) const
 
 bool ObjectPageList::set_page_loaded_status(off_t start, size_t size, bool loaded, bool need_cmp)
 {
-    size_t now_size = get_size();
-
-    if (now_size <= static_cast<size_t>(start)) {
-        if (now_size < static_cast<size_t>(start)) {
-            resize(static_cast<size_t>(start), false);
-        }
-        resize(static_cast<size_t>(start + size), loaded);
-    } else if (now_size <= static_cast<size_t>(start + size)) {
-        resize(static_cast<size_t>(start), false);
-        resize(static_cast<size_t>(start + size), loaded);
-    } else {
-        parse(start);
-        parse(start + size);
-
-        for (self_type::iterator iter = _pages.begin(); iter != _pages.end(); ++iter) {
-            if ((*iter)->end() < start) {
-                continue;
-            } else if (static_cast<off_t>(start + size) <= (*iter)->get_offset()) {
-                break;
-            } else {
-                (*iter)->set_loaded(loaded);
-            }
-        }
+    off_t next = static_cast<off_t>(start + size);
+    if (get_size() < static_cast<size_t>(next)) {
+        resize(static_cast<size_t>(next), false);
     }
-    return need_cmp ? compress() : true;
+    if (0 == size) {
+        return true;
+    }
+    // splitting at next only inserts behind first
+    size_t first = parse(start);
+    size_t last = parse(next);
+    _pages[first] = ObjectPage(start, size, loaded);
+    _pages.erase(_pages.begin() + first + 1, _pages.begin() + last);
+    if (need_cmp) {
+        compress(first);
+    }
+    return true;
 }
 
 bool ObjectPageList::find_unloaded_pate(off_t start, off_t &ret_start, size_t &ret_size) const
 {
-    for (self_type::const_iterator iter = _pages.begin(); iter != _pages.end(); ++iter) {
-        if (start < (*iter)->end()) {
-            if (!(*iter)->get_loaded()) {
-                ret_start = (*iter)->get_offset();
-                ret_size  = (*iter)->get_bytes();
-                return true;
-            }
+    for (size_t i = find_page(start); i < _pages.size(); ++i) {
+        if (start < _pages[i].end() && !_pages[i].get_loaded()) {
+            ret_start = _pages[i].get_offset();
+            ret_size  = _pages[i].get_bytes();
+            return true;
         }
     }
     return false;
@@ -161,31 +140,12 @@ size_t ObjectPageList::get_total_unloaded_page_size(off_t start, size_t size) co
 {
     size_t ret_size = 0;
     off_t next = static_cast<off_t>(start + size);
-    for (self_type::const_iterator iter = _pages.begin(); iter != _pages.end(); ++iter) {
-        if ((*iter)->next() <= start) {
-            continue;
-        }
-        if (next <= (*iter)->get_offset()) {
-            break;
-        }
-        if ((*iter)->get_loaded()) {
+    for (size_t i = find_page(start); i < _pages.size() && _pages[i].get_offset() < next; ++i) {
+        if (_pages[i].get_loaded()) {
             continue;
         }
-        size_t tmp_size = 0;
-        if ((*iter)->get_offset() <= start) {
-            if ((*iter)->next() <= next) {
-                tmp_size = static_cast<size_t>((*iter)->next() - start);
-            } else {
-                tmp_size = static_cast<size_t>(next - start);
-            }
-        } else {
-            if ((*iter)->next() <= next) {
-                tmp_size = static_cast<size_t>((*iter)->next() - (*iter)->get_offset());
-            } else {
-                tmp_size = static_cast<size_t>(next - (*iter)->get_offset());
-            }
-        }
-        ret_size += tmp_size;
+        ret_size += static_cast<size_t>(std::min(_pages[i].next(), next) -
+                std::max(_pages[i].get_offset(), start));
     }
     return ret_size;
 }
@@ -199,115 +159,134 @@ int ObjectPageList::get_unloaded_pages(self_type &unloaded_list, off_t start, si
         }
     }
     off_t next = static_cast<off_t>(start + size);
-    for (self_type::const_iterator iter = _pages.begin(); iter != _pages.end(); ++iter) {
-        if ((*iter)->next() <= start) {
-            continue;
-        }
-        if (next <= (*iter)->get_offset()) {
-            break;
-        }
-        if ((*iter)->get_loaded()) {
+    for (size_t i = find_page(start); i < _pages.size() && _pages[i].get_offset() < next; ++i) {
+        if (_pages[i].get_loaded()) {
             continue;
         }
 
-        off_t page_start = std::max((*iter)->get_offset(), start);
-        off_t page_next = std::min((*iter)->next(), next);
+        off_t page_start = std::max(_pages[i].get_offset(), start);
+        off_t page_next = std::min(_pages[i].next(), next);
         size_t page_size = static_cast<size_t>(page_next - page_start);
 
-        self_type::reverse_iterator rite = unloaded_list.rbegin();
-        if (rite != unloaded_list.rend() && (*rite)->next() == page_start) {
-            (*rite)->set_bytes((*rite)->get_bytes() + page_size);
+        if (!unloaded_list.empty() && unloaded_list.back().next() == page_start) {
+            unloaded_list.back().set_bytes(unloaded_list.back().get_bytes() + page_size);
         } else {
-            ObjectPage *page = new ObjectPage(page_start, page_size, false);
-            unloaded_list.push_back(page);
+            unloaded_list.push_back(ObjectPage(page_start, page_size, false));
         }
     }
 
     return unloaded_list.size();
 }
 
-bool ObjectPageList::serialize(StatCacheFile &file, bool is_output) {
-    if (!file.open_file()) {
-        return false;
+// FNV-1a, only meant to find stat files torn by a crash
+static uint32_t stat_checksum(const char *data, size_t size)
+{
+    uint32_t h = 2166136261u;
+    for (size_t i = 0; i < size; ++i) {
+        h ^= (unsigned char) data[i];
+        h *= 16777619u;
     }
-    if (is_output) {
-        std::stringstream ssall;
-        ssall << get_size();
-
-        for (self_type::iterator iter = _pages.begin(); iter != _pages.end(); ++iter) {
-            ssall << "\n" << (*iter)->get_offset() << ":" << (*iter)->get_bytes() << ":"
-                << ((*iter)->get_loaded() ? "1" : "0");
-        }
+    return h;
+}
 
-        std::string strall = ssall.str();
-        if (0 >= pwrite(file.get_fd(), strall.c_str(), strall.length(), 0)) {
+bool ObjectPageList::serialize(StatCacheFile &file, bool is_output, std::string &etag,
+        int64_t &last_modified) {
+    if (is_output) {
+        std::string body(etag);
+        uint32_t range_count = 0;
+        for (size_t i = 0; i < _pages.size(); ++i) {
+            if (!_pages[i].get_loaded() || 0 == _pages[i].get_bytes()) {
+                continue;
+            }
+            uint64_t range[2] = {
+                static_cast<uint64_t>(_pages[i].get_offset()),
+                static_cast<uint64_t>(_pages[i].get_bytes())
+            };
+            body.append(reinterpret_cast<const char *>(range), sizeof(range));
+            ++range_count;
+        }
+        StatHeader header;
+        memset(&header, 0, sizeof(header));
+        header.magic = STAT_MAGIC;
+        header.version = STAT_VERSION;
+        header.size = get_size();
+        header.last_modified = last_modified;
+        header.etag_size = etag.size();
+        header.range_count = range_count;
+        header.checksum = stat_checksum(body.data(), body.size());
+        body.insert(0, reinterpret_cast<const char *>(&header), sizeof(header));
+        if (!file.write_file(body)) {
             BOSFS_ERR("failed to write stats(%d)", errno);
             return false;
         }
-    } else {
-        struct stat st;
-        memset(&st, 0, sizeof(struct stat));
-        if (-1 == fstat(file.get_fd(), &st)) {
-            BOSFS_ERR("fstat is failed. errno(%d)", errno);
-            return false;
-        }
-        if (0 >= st.st_size) {
-            init(0, false);
-            return true;
-        }
-        SmartArray<char> tmp(st.st_size + 1);
-        char *ptmp = tmp.get();
-
-        if (0 >= pread(file.get_fd(), ptmp, st.st_size, 0)) {
-            BOSFS_ERR("failed to read stats(%d)", errno);
-            return false;
-        }
-        std::string       oneline;
-        std::stringstream ssall(ptmp);
+        return true;
+    }
 
-        clear();
+    if (!file.open_file()) {
+        return false;
+    }
+    struct stat st;
+    memset(&st, 0, sizeof(struct stat));
+    if (-1 == fstat(file.get_fd(), &st)) {
+        BOSFS_ERR("fstat is failed. errno(%d)", errno);
+        return false;
+    }
+    StatHeader header;
+    if (static_cast<size_t>(st.st_size) < sizeof(header)
+            || sizeof(header) != pread(file.get_fd(), &header, sizeof(header), 0)) {
+        BOSFS_WARN("stats of unknown format, ignored");
+        return false;
+    }
+    // stats of older versions are dropped, the cache file is then loaded again
+    if (header.magic != STAT_MAGIC || header.version != STAT_VERSION) {
+        BOSFS_WARN("stats of unknown format or version(%u), ignored", header.version);
+        return false;
+    }
+    size_t body_size = header.etag_size + 2 * sizeof(uint64_t) * header.range_count;
+    if (static_cast<size_t>(st.st_size) != sizeof(header) + body_size) {
+        BOSFS_ERR("stats of wrong size(%jd), ignored", (intmax_t) st.st_size);
+        return false;
+    }
+    std::string body(body_size, '\0');
+    if (0 != body_size && static_cast<ssize_t>(body_size) !=
+            pread(file.get_fd(), &body[0], body_size, sizeof(header))) {
+        BOSFS_ERR("failed to read stats(%d)", errno);
+        return false;
+    }
+    if (header.checksum != stat_checksum(body.data(), body.size())) {
+        BOSFS_ERR("stats are corrupted, ignored");
+        return false;
+    }
 
-        if (!std::getline(ssall, oneline, '\n')) {
-            BOSFS_ERR("failed to parse stats.");
+    clear();
+    const char *ranges = body.data() + header.etag_size;
+    uint64_t pos = 0;
+    for (uint32_t i = 0; i < header.range_count; ++i) {
+        uint64_t range[2];
+        memcpy(range, ranges + i * sizeof(range), sizeof(range));
+        if (range[0] < pos || 0 == range[1] || range[1] > header.size
+                || range[0] > header.size - range[1]) {
+            BOSFS_ERR("stats have a bad range(%ju:%ju), ignored",
+                    (uintmax_t) range[0], (uintmax_t) range[1]);
+            init(0, false);
             return false;
         }
-        size_t total = strtoll(oneline.c_str(), NULL, 10);
-
-        bool is_err = false;
-        while (std::getline(ssall, oneline, '\n')) {
-            std::string       part;
-            std::stringstream ssparts(oneline);
-
-            if (!std::getline(ssparts, part, ':')) {
-                is_err = true;
-                break;
-            }
-            off_t offset = strtoll(part.c_str(), NULL, 10);
-
-            if (!std::getline(ssparts, part, ':')) {
-                is_err = true;
-                break;
-            }
-            off_t size = strtoll(part.c_str(), NULL, 10);
-            if (!std::getline(ssparts, part, ':')) {
-                is_err = true;
-                break;
-            }
-            bool is_loaded = strtoll(part.c_str(), NULL, 10) != 0;
-            set_page_loaded_status(offset, size, is_loaded);
+        if (range[0] > pos) {
+            _pages.push_back(ObjectPage(pos, range[0] - pos, false));
         }
-        if (is_err) {
-            BOSFS_ERR("failed to parse stats.");
-            clear();
-            return false;
-        }
-
-        if (total != get_size()) {
-            BOSFS_ERR("different size(%jd - %jd).", (intmax_t) total, (intmax_t) get_size());
-            clear();
-            return false;
+        if (!_pages.empty() && _pages.back().get_loaded()
+                && _pages.back().next() == static_cast<off_t>(range[0])) {
+            _pages.back().set_bytes(_pages.back().get_bytes() + range[1]);
+        } else {
+            _pages.push_back(ObjectPage(range[0], range[1], true));
         }
+        pos = range[0] + range[1];
     }
+    if (pos < header.size || _pages.empty()) {
+        _pages.push_back(ObjectPage(pos, header.size - pos, false));
+    }
+    etag.assign(body.data(), header.etag_size);
+    last_modified = header.last_modified;
     return true;
 }
 
@@ -317,12 +296,11 @@ void ObjectPageList::dump()
     std::ostringstream oss;
     oss << "pages = [";
     for (self_type::iterator it = _pages.begin(); it != _pages.end(); ++it) {
-        ObjectPage *page = *it;
         if (cnt > 0) {
             oss << "->";
         }
-        oss << "(off=" << page->get_offset() << ",size=" << page->get_bytes() <<
-            ",load=" << page->get_loaded() << ")";
+        oss << "(off=" << it->get_offset() << ",size=" << it->get_bytes() <<
+            ",load=" << it->get_loaded() << ")";
         ++cnt;
     }
     oss << "]";
@@ -333,56 +311,52 @@ void ObjectPageList::clear()
 {
     ObjectPageList::free_list(_pages);
 }
-//合并page
-bool ObjectPageList::compress()
+
+size_t ObjectPageList::find_page(off_t pos) const
 {
-    bool is_first = true;
-    bool is_last_loaded = false;
-    for (self_type::iterator iter = _pages.begin(); iter != _pages.end();) {
-        if (is_first) {
-            is_first = false;
-            is_last_loaded = (*iter)->get_loaded();
-            ++iter;
-        } else {
-            if (is_last_loaded == (*iter)->get_loaded()) {
-                self_type::iterator bite = iter;
-                --bite;
-                (*bite)->set_bytes((*bite)->get_bytes() + (*iter)->get_bytes());
-                delete *iter;
-                iter = _pages.erase(iter);
-            } else {
-                is_last_loaded = (*iter)->get_loaded();
-                ++iter;
-            }
-        }
+    self_type::const_iterator iter = std::upper_bound(_pages.begin(), _pages.end(), pos,
+            offset_less);
+    if (iter == _pages.begin()) {
+        return _pages.size();
     }
-
-    return true;
+    --iter;
+    return pos < iter->next() ? static_cast<size_t>(iter - _pages.begin()) : _pages.size();
 }
 
-bool ObjectPageList::parse(off_t new_pos)
+//合并page
+void ObjectPageList::compress(size_t index)
 {
-    for (self_type::iterator iter = _pages.begin(); iter != _pages.end(); ++iter) {
-        if (new_pos == (*iter)->get_offset()) {
-            return true;
-        } else if ((*iter)->get_offset() < new_pos && new_pos < (*iter)->next()) {
-            ObjectPage *page = new ObjectPage((*iter)->get_offset(),
-                    static_cast<size_t>(new_pos - (*iter)->get_offset()),
-                    (*iter)->get_loaded());
-            (*iter)->set_bytes((*iter)->get_bytes() - new_pos + (*iter)->get_offset());
-            (*iter)->set_offset(new_pos);
-            _pages.insert(iter, page);
-            return true;
-        }
+    if (index + 1 < _pages.size() && _pages[index + 1].get_loaded() == _pages[index].get_loaded()) {
+        _pages[index].set_bytes(_pages[index].get_bytes() + _pages[index + 1].get_bytes());
+        _pages.erase(_pages.begin() + index + 1);
+    }
+    if (0 < index && _pages[index - 1].get_loaded() == _pages[index].get_loaded()) {
+        _pages[index - 1].set_bytes(_pages[index - 1].get_bytes() + _pages[index].get_bytes());
+        _pages.erase(_pages.begin() + index);
     }
-    return false;
+}
+
+size_t ObjectPageList::parse(off_t new_pos)
+{
+    size_t index = find_page(new_pos);
+    if (index == _pages.size() || _pages[index].get_offset() == new_pos) {
+        return index;
+    }
+    ObjectPage &page = _pages[index];
+    ObjectPage head(page.get_offset(), static_cast<size_t>(new_pos - page.get_offset()),
+            page.get_loaded());
+    off_t next = page.next();
+    page.set_offset(new_pos);
+    page.set_bytes(next - new_pos);
+    _pages.insert(_pages.begin() + index, head);
+    return index + 1;
 }
 
 // Definition of class StatCacheFile
 StatCacheFile::StatCacheFile(DataCache *data_cache, const char *path)
     : _data_cache(data_cache), _path(""), _fd(-1) {
     if (path && '\0' != path[0]) {
-        set_path(path, true);
+        set_path(path, false);
     }
 }
 
@@ -402,32 +376,16 @@ bool StatCacheFile::open_file()
     }
 
     std::string stat_file;
-    if (!_data_cache->make_path(_path.c_str(), stat_file, true)) {
-        BOSFS_ERR("failed to create stat cache file path(%s)", _path.c_str());
+    if (!_data_cache->make_path(_path.c_str(), stat_file, false)) {
         return false;
     }
 
-    if (-1 == (_fd = open(stat_file.c_str(), O_CREAT|O_RDWR, 0600))) {
-        BOSFS_ERR("failed to open stat cache file path(%s) - errno(%d)", _path.c_str(), errno);
-        return false;
-    }
-
-    if (-1 == flock(_fd, LOCK_EX)) {
-        BOSFS_ERR("failed to lock stat cache file path(%s) - errno(%d)", _path.c_str(), errno);
-        flock(_fd, LOCK_UN);
-        close(_fd);
-        _fd = -1;
-        return false;
-    }
-
-    if (0 != lseek(_fd, 0, SEEK_SET)) {
-        BOSFS_ERR("failed to lseek stat cache file path(%s) - errno(%d)", _path.c_str(), errno);
-        flock(_fd, LOCK_UN);
-        close(_fd);
-        _fd = -1;
+    if (-1 == (_fd = open(stat_file.c_str(), O_RDONLY))) {
+        if (ENOENT != errno) {
+            BOSFS_ERR("failed to open stat cache file path(%s) - errno(%d)", _path.c_str(), errno);
+        }
         return false;
     }
-    BOSFS_DEBUG("file locked (%s - %s)", _path.c_str(), stat_file.c_str());
     return true;
 }
 
@@ -437,12 +395,6 @@ bool StatCacheFile::release()
         return true;
     }
 
-    if (-1 == flock(_fd, LOCK_UN)) {
-        BOSFS_ERR("failed to unlock stat cache file path(%s) - errno(%d)", _path.c_str(), errno);
-        return false;
-    }
-    BOSFS_DEBUG("file unlocked (%s)", _path.c_str());
-
     if (-1 == close(_fd)) {
         BOSFS_ERR("failed to close stat cache file path(%s) - errno(%d)", _path.c_str(), errno);
         return false;
@@ -470,6 +422,39 @@ bool StatCacheFile::set_path(const char *path, bool is_open)
     return open_file();
 }
 
+bool StatCacheFile::write_file(const std::string &data)
+{
+    if (0 == _path.size()) {
+        return false;
+    }
+    std::string stat_file;
+    if (!_data_cache->make_path(_path.c_str(), stat_file, true)) {
+        BOSFS_ERR("failed to create stat cache file path(%s)", _path.c_str());
+        return false;
+    }
+    // rename within the same dir is atomic, pid and thread keep writers apart
+    std::ostringstream tmp;
+    tmp << stat_file.substr(0, stat_file.rfind('/') + 1) << ".bosfs.stat."
+        << getpid() << "." << (unsigned long) pthread_self();
+    std::string tmp_file = tmp.str();
+    int fd = open(tmp_file.c_str(), O_CREAT|O_TRUNC|O_WRONLY, 0600);
+    if (-1 == fd) {
+        BOSFS_ERR("failed to open stat cache file path(%s) - errno(%d)", tmp_file.c_str(), errno);
+        return false;
+    }
+    bool ok = static_cast<ssize_t>(data.size()) == pwrite(fd, data.data(), data.size(), 0);
+    int err = errno;
+    close(fd);
+    if (!ok || -1 == rename(tmp_file.c_str(), stat_file.c_str())) {
+        err = ok ? errno : err;
+        BOSFS_ERR("failed to write stat cache file path(%s) - errno(%d)", _path.c_str(), err);
+        unlink(tmp_file.c_str());
+        errno = err;
+        return false;
+    }
+    return true;
+}
+
 bool DataCache::make_path(const char *path, std::string &file_path, bool is_create_dir)
 {
     // Make stat cache path: /<cache_path>/.<bucket_name>.stat
@@ -499,7 +484,7 @@ DataCacheEntity::DataCacheEntity(BosfsUtil *bosfs_util, DataCache *data_cache, F
     : _bosfs_util(bosfs_util), _data_cache(data_cache), _file_manager(file_manager),
       _ref_count(0), _path(""), _cache_path(""), _mirror_path(""), _fd(-1),
       _is_modified(false), _origin_meta_size(0), _upload_id(""), _mp_start(0), _mp_size(0),
-      _is_tmpfile(false) {
+      _is_tmpfile(false), _access_seq(0) {
     _path = tpath ? tpath : "";
     _cache_path = cpath ? cpath : "";
 
@@ -567,8 +552,7 @@ int DataCacheEntity::close_file()
         _tmp_filename.clear();
     }
     if (0 != _cache_path.size()) {
-        StatCacheFile stat_cache(_data_cache, _path.c_str());
-        if (!_page_list.serialize(stat_cache, true)) {
+        if (!save_stat()) {
             BOSFS_WARN("failed to save stat cache file (%s)", _path.c_str());
         }
     }
@@ -602,6 +586,20 @@ int DataCacheEntity::truncate(off_t size) {
     return 0;
 }
 
+// cached pages belong to the object version they were loaded from. an empty etag is
+// never known to match, it is saved while local data differs from any uploaded one.
+// last modified time is 0 when bos did not tell it, and is only compared if both sides
+// know it
+static bool is_same_version(const ObjectMetaData *pmeta, const std::string &etag,
+        int64_t last_modified) {
+    if (pmeta == NULL || etag.empty() || etag != pmeta->etag()) {
+        return false;
+    }
+    int64_t meta_last_modified = static_cast<int64_t>(pmeta->last_modified());
+    return last_modified == 0 || meta_last_modified == 0
+        || last_modified == meta_last_modified;
+}
+
 int DataCacheEntity::open_file(ObjectMetaData *pmeta, ssize_t size, time_t time) {
     BOSFS_DEBUG("[path=%s][fd=%d][size=%jd][time=%jd]", _path.c_str(), _fd,
             (intmax_t)size, (intmax_t)time);
@@ -620,9 +618,14 @@ int DataCacheEntity::open_file(ObjectMetaData *pmeta, ssize_t size, time_t time)
 
         // open cache and cache stat file, load page info.
         StatCacheFile cfstat(_data_cache, _path.c_str());
-
-        // try to open cache file
-        if (-1 != (_fd = open(_cache_path.c_str(), O_RDWR)) && _page_list.serialize(cfstat, false)) {
+        std::string cached_etag;
+        int64_t cached_last_modified = 0;
+
+        // try to open cache file, its pages are reused only if they were loaded from the
+        // object version being opened
+        if (-1 != (_fd = open(_cache_path.c_str(), O_RDWR))
+                && _page_list.serialize(cfstat, false, cached_etag, cached_last_modified)
+                && is_same_version(pmeta, cached_etag, cached_last_modified)) {
             // succeed to open cache file and to load stats data
             struct stat st;
             memset(&st, 0, sizeof(struct stat));
@@ -648,7 +651,11 @@ int DataCacheEntity::open_file(ObjectMetaData *pmeta, ssize_t size, time_t time)
                 }
             }
         }else{
-            // could not open cache file or could not load stats data, so initialize it.
+            // could not open cache file, could not load stats data or they are stale, so
+            // initialize it.
+            if (-1 != _fd) {
+                close(_fd);
+            }
             if (-1 == (_fd = open(_cache_path.c_str(), O_CREAT|O_RDWR|O_TRUNC, 0600))) {
                 BOSFS_ERR("failed to open file(%s). errno(%d)", _cache_path.c_str(), errno);
                 return (0 == errno ? -EIO : -errno);
@@ -658,7 +665,7 @@ int DataCacheEntity::open_file(ObjectMetaData *pmeta, ssize_t size, time_t time)
                 size = 0;
                 _page_list.init(0, false);
             } else {
-                _page_list.resize(static_cast<size_t>(size), false);
+                _page_list.init(static_cast<size_t>(size), false);
                 is_truncate = true;
             }
         }
@@ -708,19 +715,7 @@ int DataCacheEntity::open_file(ObjectMetaData *pmeta, ssize_t size, time_t time)
         }
     }
 
-    // reset cache stat file
-    if (need_save_csf) {
-        StatCacheFile cfstat(_data_cache, _path.c_str());
-        if (!_page_list.serialize(cfstat, true)) {
-            BOSFS_WARN("failed to save cache stat file(%s), but continue...", _path.c_str());
-        }
-    }
-
-    // init internal data
-    _ref_count = 1;
-    _is_modified = false;
-
-    // set original headers and size in it.
+    // set original headers and size in it, saved stats carry its etag
     if (pmeta) {
         _origin_meta.copy_from(*pmeta);
         _origin_meta_size = _origin_meta.content_length();
@@ -732,6 +727,17 @@ int DataCacheEntity::open_file(ObjectMetaData *pmeta, ssize_t size, time_t time)
         _origin_meta.set_storage_class(_bosfs_util->options().storage_class);
     }
 
+    // reset cache stat file
+    if (need_save_csf) {
+        if (!save_stat()) {
+            BOSFS_WARN("failed to save cache stat file(%s), but continue...", _path.c_str());
+        }
+    }
+
+    // init internal data
+    _ref_count = 1;
+    _is_modified = false;
+
     // set mtime(set "x-bce-meta-mtime")
     if (-1 != time) {
         if (0 != set_mtime(time)) {
@@ -882,6 +888,20 @@ void DataCacheEntity::set_xattr(const std::string &xattr) {
     _origin_meta.set_user_meta("bosfs-xattr", xattr);
 }
 
+void DataCacheEntity::rebase_version(const std::string &old_etag, const std::string &etag,
+        time_t last_modified)
+{
+    AutoLock auto_lock(&_entity_lock);
+    if (old_etag.empty() || _origin_meta.etag() != old_etag) {
+        return;
+    }
+    _origin_meta.set_etag(etag);
+    _origin_meta.set_last_modified(last_modified);
+    if (0 != _cache_path.size() && !save_stat()) {
+        BOSFS_WARN("failed to save stat cache file (%s)", _path.c_str());
+    }
+}
+
 int DataCacheEntity::load(off_t start, size_t size)
 {
     BOSFS_DEBUG("[path=%s][fd=%d][offset=%jd][size=%jd]", _path.c_str(), _fd,
@@ -903,33 +923,33 @@ int DataCacheEntity::load(off_t start, size_t size)
     off_t end = start + size;
     for (ObjectPageList::self_type::iterator iter = unloaded_list.begin();
             iter != unloaded_list.end(); ++iter) {
-        if (end <= (*iter)->get_offset()) {
+        if (end <= iter->get_offset()) {
             break;
         }
-        ObjectPage *page = *iter;
+        const ObjectPage &page = *iter;
 
         size_t need_load_size = 0;
         size_t over_size = 0;
-        if ((off_t) _origin_meta_size > page->get_offset()) {
-            if ((off_t) _origin_meta_size >= page->next()) {
-                need_load_size = page->get_bytes();
+        if ((off_t) _origin_meta_size > page.get_offset()) {
+            if ((off_t) _origin_meta_size >= page.next()) {
+                need_load_size = page.get_bytes();
             } else {
-                need_load_size = _origin_meta_size - page->get_offset();
-                over_size = page->next() - _origin_meta_size;
+                need_load_size = _origin_meta_size - page.get_offset();
+                over_size = page.next() - _origin_meta_size;
             }
         }
 
         if (0 < need_load_size) {
             BOSFS_INFO("unloaded page off: %ld, size: %ld, need_load: %u, origin: %ld",
-                    page->get_offset(), page->get_bytes(), need_load_size, _origin_meta_size);
+                    page.get_offset(), page.get_bytes(), need_load_size, _origin_meta_size);
             result = _bosfs_util->bos_client()->parallel_download(_bosfs_util->options().bucket, _path, _fd,
-                    page->get_offset(), need_load_size);
+                    page.get_offset(), need_load_size);
             if (0 != result) {
                 break;
             }
         }
         if (0 < over_size) {
-            result = fill_file(_fd, 0, over_size, (*iter)->get_offset() + need_load_size);
+            result = fill_file(_fd, 0, over_size, iter->get_offset() + need_load_size);
             if (result != 0) {
                 BOSFS_ERR("failed to fill rest bytes for fd(%d), errno(%d)", _fd, result);
                 break;
@@ -937,7 +957,7 @@ int DataCacheEntity::load(off_t start, size_t size)
             _is_modified = false;
         }
 
-        _page_list.set_page_loaded_status((*iter)->get_offset(), (*iter)->get_bytes(), true);
+        _page_list.set_page_loaded_status(iter->get_offset(), iter->get_bytes(), true);
     }
     ObjectPageList::free_list(unloaded_list);
     return result;
@@ -982,7 +1002,28 @@ int DataCacheEntity::row_flush(const char *tpath, bool force_sync)
         return -1;
     }
     _is_modified = false;
-    _file_manager->del(_path);
+    // etag of the upload is not returned, one HEAD tells it and the last modified time
+    // of bos. local data is then the version just uploaded and reused from now on, unless
+    // the size shows the object was replaced meanwhile
+    ObjectMetaData meta;
+    bool is_dir_obj = false;
+    bool is_prefix = false;
+    _origin_meta.set_etag("");
+    _origin_meta.set_last_modified(0);
+    if (BOSFS_OK == _bosfs_util->head_object(object_name, &meta, &is_dir_obj, &is_prefix)
+            && !is_dir_obj) {
+        if ((size_t) meta.content_length() == _page_list.get_size()) {
+            _origin_meta.set_etag(meta.etag());
+            _origin_meta.set_last_modified(meta.last_modified());
+        }
+    } else {
+        meta.copy_from(_origin_meta);
+        meta.set_content_length(_page_list.get_size());
+    }
+    if (0 != _cache_path.size() && !save_stat()) {
+        BOSFS_WARN("failed to save stat cache file (%s)", _path.c_str());
+    }
+    _bosfs_util->cache_written_meta("/" + object_name, meta, false);
     return 0;
 }
 
@@ -1004,20 +1045,10 @@ ssize_t DataCacheEntity::read(char *bytes, off_t start, size_t size, bool force_
         _page_list.set_page_loaded_status(start, size, false);
     }
 
-    // Check disk space
+    touch_blocks(start, size);
+
     int ret = 0;
     if (0 < _page_list.get_total_unloaded_page_size(start, size)) {
-        if (!is_safe_disk_space(size)) {
-            if (!_is_modified) {
-                _page_list.init(_page_list.get_size(), false);
-                // free blocks on disk
-                if (-1 == ftruncate(_fd, 0) || -1 == ftruncate(_fd, _page_list.get_size())) {
-                    BOSFS_ERR("failed to truncate temporary file %d", _fd);
-                    return -ENOSPC;
-                }
-            }
-        }
-
         // Prefetch load size
         size_t load_size = size;
         if (static_cast<size_t>(start + size) < _page_list.get_size()) {
@@ -1031,6 +1062,20 @@ ssize_t DataCacheEntity::read(char *bytes, off_t start, size_t size, bool force_
             }
         }
 
+        // Check disk space, free cold blocks of this file only if evicting other files
+        // is not enough and drop all of it only if that is not enough either
+        if (!_is_modified && !make_cache_space(load_size)) {
+            free_cold_blocks(start, load_size);
+            if (!is_safe_disk_space(size)) {
+                _page_list.init(_page_list.get_size(), false);
+                // free blocks on disk
+                if (-1 == ftruncate(_fd, 0) || -1 == ftruncate(_fd, _page_list.get_size())) {
+                    BOSFS_ERR("failed to truncate temporary file %d", _fd);
+                    return -ENOSPC;
+                }
+            }
+        }
+
         // Loading
         ret = load(start, load_size);
         if (ret != 0) {
@@ -1082,6 +1127,16 @@ ssize_t DataCacheEntity::write(const char *bytes, off_t start, size_t size)
     }
     BOSFS_DEBUG("write to fd: %d, off: %ld, size: %ld", _fd, start, size);
 
+    // saved stats must stop matching the object before local data differs from it, or
+    // the data would be reused if we crash before uploading
+    if (!_origin_meta.etag().empty()) {
+        _origin_meta.set_etag("");
+        if (0 != _cache_path.size() && !save_stat()) {
+            BOSFS_ERR("failed to save stat cache file (%s)", _path.c_str());
+            return -EIO;
+        }
+    }
+
     // Do writing from start to start + size
     ssize_t write_size = -1;
     if (-1 == (write_size = pwrite(_fd, bytes, size, start))) {
@@ -1096,6 +1151,115 @@ ssize_t DataCacheEntity::write(const char *bytes, off_t start, size_t size)
     return write_size;
 }
 
+bool DataCacheEntity::make_cache_space(size_t size)
+{
+    if (!is_safe_disk_space(size)) {
+        return false;
+    }
+    int64_t capacity = _data_cache->capacity();
+    if (_is_tmpfile || capacity <= 0) {
+        return true;
+    }
+    // other files are counted as the evictor last saw them, this one as it is now
+    size_t loaded = _page_list.get_size() - _page_list.get_total_unloaded_page_size();
+    int64_t shortfall = _data_cache->cached_bytes_except(_path)
+        + static_cast<int64_t>(loaded + size) - capacity;
+    if (shortfall <= 0) {
+        return true;
+    }
+    // the evictor thread is only woken past capacity, so make room here. our own entity
+    // lock is held, files whose lock of data cache is busy are left to the evictor
+    return _data_cache->free_space(shortfall, _path) >= shortfall;
+}
+
+void DataCacheEntity::touch_blocks(off_t start, size_t size)
+{
+    // reads past the end load nothing, blocks are only kept for the file as it is
+    size_t file_size = _page_list.get_size();
+    if (0 == size || static_cast<size_t>(start) >= file_size) {
+        return;
+    }
+    size_t first = start / EVICT_BLOCK_SIZE;
+    size_t last = (std::min(start + size, file_size) - 1) / EVICT_BLOCK_SIZE;
+    if (_block_access.size() <= last) {
+        _block_access.resize(last + 1, 0);
+    }
+    ++_access_seq;
+    for (size_t i = first; i <= last; ++i) {
+        _block_access[i] = _access_seq;
+    }
+}
+
+bool DataCacheEntity::free_cold_blocks(off_t start, size_t size)
+{
+#ifndef __APPLE__
+    // loaded blocks outside of the range about to be read, coldest first
+    std::vector<std::pair<uint64_t, size_t> > blocks;
+    size_t first = start / EVICT_BLOCK_SIZE;
+    size_t last = (start + size - 1) / EVICT_BLOCK_SIZE;
+    for (size_t i = 0; i < _page_list._pages.size(); ++i) {
+        const ObjectPage &page = _page_list._pages[i];
+        if (!page.get_loaded() || 0 == page.get_bytes()) {
+            continue;
+        }
+        size_t block = page.get_offset() / EVICT_BLOCK_SIZE;
+        // a block shared with the previous page is taken already
+        if (!blocks.empty() && blocks.back().second == block) {
+            ++block;
+        }
+        for (; block <= static_cast<size_t>(page.end() / EVICT_BLOCK_SIZE); ++block) {
+            if (block >= first && block <= last) {
+                continue;
+            }
+            uint64_t access = block < _block_access.size() ? _block_access[block] : 0;
+            blocks.push_back(std::make_pair(access, block));
+        }
+    }
+
+    size_t loaded = _page_list.get_size() - _page_list.get_total_unloaded_page_size();
+    size_t want = std::max(size, std::max(loaded / 100 * EVICT_BATCH_PERCENT,
+            static_cast<size_t>(EVICT_BLOCK_SIZE) * EVICT_MIN_BLOCKS));
+    size_t freed = 0;
+    size_t count = 0;
+    size_t sorted = 0;
+    for (; count < blocks.size() && freed < want; ++count) {
+        if (count == sorted) {
+            // only the coldest are ordered, partly loaded blocks may call for more
+            sorted = std::min(blocks.size(), count + want / EVICT_BLOCK_SIZE + 1);
+            std::partial_sort(blocks.begin() + count, blocks.begin() + sorted, blocks.end());
+        }
+        off_t offset = static_cast<off_t>(blocks[count].second) * EVICT_BLOCK_SIZE;
+        size_t bytes = std::min(static_cast<size_t>(EVICT_BLOCK_SIZE),
+                static_cast<size_t>(_page_list.get_size() - offset));
+        freed += bytes - _page_list.get_total_unloaded_page_size(offset, bytes);
+        _page_list.set_page_loaded_status(offset, bytes, false);
+    }
+    if (0 == count) {
+        return false;
+    }
+    // stats must not claim blocks which are about to be punched out
+    if (0 != _cache_path.size() && !save_stat()) {
+        BOSFS_WARN("failed to save stat cache file (%s)", _path.c_str());
+        return false;
+    }
+    for (size_t i = 0; i < count; ++i) {
+        off_t offset = static_cast<off_t>(blocks[i].second) * EVICT_BLOCK_SIZE;
+        size_t bytes = std::min(static_cast<size_t>(EVICT_BLOCK_SIZE),
+                static_cast<size_t>(_page_list.get_size() - offset));
+        if (-1 == fallocate(_fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset, bytes)) {
+            BOSFS_WARN("failed to punch hole in cache file of %s, errno(%d)",
+                    _path.c_str(), errno);
+            return false;
+        }
+    }
+    BOSFS_INFO("freed %zu cold blocks of %zu bytes in cache file of %s", count, freed,
+            _path.c_str());
+    return true;
+#else
+    return false;
+#endif
+}
+
 int DataCacheEntity::fill_file(int fd, unsigned char byte, size_t size, off_t start)
 {/*{{{*/
     unsigned char bytes[32 * 1024];
@@ -1118,8 +1282,7 @@ void DataCacheEntity::clear()
     if (_fd >= 0) {
         BOSFS_WARN("try clear all, but local file still open, close fd:%d", _fd);
         if (0 != _cache_path.size()) {
-            StatCacheFile statcf(_data_cache, _path.c_str());
-            if (!_page_list.serialize(statcf, true)) {
+            if (!save_stat()) {
                 BOSFS_WARN("failed to save stat cache to file (%s)", _path.c_str());
             }
         }
@@ -1146,6 +1309,14 @@ void DataCacheEntity::clear()
     _is_modified = false;
 }/*}}}*/
 
+bool DataCacheEntity::save_stat()
+{
+    StatCacheFile stat_cache(_data_cache, _path.c_str());
+    std::string etag = _origin_meta.etag();
+    int64_t last_modified = _origin_meta.last_modified();
+    return _page_list.serialize(stat_cache, true, etag, last_modified);
+}
+
 int DataCacheEntity::open_mirror_file()
 {/*{{{*/
     if (_cache_path.empty()) {
@@ -1223,6 +1394,7 @@ int DataCache::delete_cache_file(const char *path)
     if (0 == _cache_dir.size()) {
         return 0;
     }
+    _evictor.remove(path);
 
     std::string cache_path = "";
     if (!make_cache_path(path, cache_path, false)) {
@@ -1268,6 +1440,113 @@ int DataCache::set_cache_dir(const std::string &dir) {
     return 0;
 }
 
+void DataCache::invalidate(const char *path, bool subtree)
+{
+    if (_cache_dir.empty()) {
+        return;
+    }
+    std::string cache_path;
+    struct stat st;
+    if (!make_cache_path(path, cache_path, false) || 0 != lstat(cache_path.c_str(), &st)) {
+        return;
+    }
+    if (!S_ISDIR(st.st_mode)) {
+        delete_unless_open(path);
+    } else if (subtree) {
+        invalidate_dir(strcmp(path, "/") == 0 ? "" : path, cache_path);
+    }
+}
+
+void DataCache::invalidate_dir(const std::string &path, const std::string &cache_dir)
+{
+    DIR *pdir = opendir(cache_dir.c_str());
+    if (pdir == NULL) {
+        return;
+    }
+    for (struct dirent *dent = readdir(pdir); dent; dent = readdir(pdir)) {
+        if (0 == strcmp(dent->d_name, "..") || 0 == strcmp(dent->d_name, ".")) {
+            continue;
+        }
+        std::string child = path + "/" + dent->d_name;
+        std::string child_cache = cache_dir + "/" + dent->d_name;
+        struct stat st;
+        if (0 != lstat(child_cache.c_str(), &st)) {
+            continue;
+        }
+        if (S_ISDIR(st.st_mode)) {
+            invalidate_dir(child, child_cache);
+            // fails as long as an open file is left inside
+            rmdir(child_cache.c_str());
+        } else {
+            delete_unless_open(child);
+        }
+    }
+    closedir(pdir);
+}
+
+void DataCache::delete_unless_open(const std::string &path)
+{
+    evict(path);
+}
+
+int DataCache::evict(const std::string &path, bool wait)
+{
+    // held while deleting, so the file can not be opened meanwhile
+    if (wait) {
+        pthread_mutex_lock(&_data_cache_lock);
+    } else if (0 != pthread_mutex_trylock(&_data_cache_lock)) {
+        return -EAGAIN;
+    }
+    int ret = -EBUSY;
+    if (_data_cache.find(path) == _data_cache.end()) {
+        delete_cache_file(path.c_str());
+        ret = 0;
+    }
+    pthread_mutex_unlock(&_data_cache_lock);
+    return ret;
+}
+
+void DataCache::rebase_version(const char *path, const std::string &old_etag,
+        const std::string &etag, time_t last_modified)
+{
+    if (old_etag.empty()) {
+        return;
+    }
+    // held while rewriting stats, so the file can not be opened meanwhile
+    AutoLock auto_lock(&_data_cache_lock);
+    DataCacheMap::iterator it = _data_cache.find(path);
+    if (it != _data_cache.end()) {
+        it->second->rebase_version(old_etag, etag, last_modified);
+        return;
+    }
+    if (_cache_dir.empty()) {
+        return;
+    }
+    ObjectPageList page_list;
+    StatCacheFile cfstat(this, path);
+    std::string cached_etag;
+    int64_t cached_last_modified = 0;
+    if (!page_list.serialize(cfstat, false, cached_etag, cached_last_modified)
+            || cached_etag != old_etag) {
+        return;
+    }
+    std::string new_etag = etag;
+    int64_t new_last_modified = last_modified;
+    if (!page_list.serialize(cfstat, true, new_etag, new_last_modified)) {
+        BOSFS_WARN("failed to save stat cache file (%s)", path);
+    }
+}
+
+void DataCache::update_evictor(const char *path)
+{
+    std::string cache_path;
+    struct stat st;
+    if (!make_cache_path(path, cache_path, false) || 0 != stat(cache_path.c_str(), &st)) {
+        return;
+    }
+    _evictor.update(path, static_cast<int64_t>(st.st_blocks) * 512);
+}
+
 bool DataCache::make_cache_path(const char *path, std::string &cache_path,
         bool is_create_dir, bool is_mirror_path)
 {
@@ -1337,11 +1616,13 @@ size_t DataCache::set_ensure_free_disk_space(size_t size)
 }
 
 DataCache::DataCache(BosfsUtil *bosfs_util, FileManager *file_manager)
-    : _bosfs_util(bosfs_util), _file_manager(file_manager), _free_disk_space(0) {
+    : _bosfs_util(bosfs_util), _file_manager(file_manager), _free_disk_space(0),
+      _evictor(this) {
     pthread_mutex_init(&_data_cache_lock, NULL);
 }
 
 DataCache::~DataCache() {
+    _evictor.stop();
     for (DataCacheMap::iterator it = _data_cache.begin(); it != _data_cache.end(); ++it) {
         delete it->second;
     }
@@ -1375,6 +1656,9 @@ DataCacheEntity * DataCache::open_cache(const char *path, ObjectMetaData *pmeta,
         }
         ent = new DataCacheEntity(_bosfs_util, this, _file_manager, path, cache_path.c_str());
         _data_cache[std::string(path)] = ent;
+        if (!cache_path.empty() && _evictor.capacity() > 0) {
+            _evictor.touch(path);
+        }
     } else {
         return NULL;
     }
@@ -1409,6 +1693,9 @@ bool DataCache::close_cache(DataCacheEntity *ent) {
     }
     ent->close_file();
     if (!ent->is_open()) {
+        if (!ent->is_tmpfile() && _evictor.capacity() > 0) {
+            update_evictor(ent->get_path());
+        }
         _data_cache.erase(it);
         delete ent;
         return true;
@@ -19,12 +19,12 @@
 #include <string>
 #include <vector>
 #include <map>
-#include <list>
 
 #include <pthread.h>
 
 #include "common.h"
 #include "util.h"
+#include "cache_evictor.h"
 #include "bcesdk/bos/client.h"
 
 #if defined(P_tmpdir)
@@ -100,11 +100,15 @@ private:
 
 /**
  * Manage the object for loading, modifying and area
+ *
+ * Pages are kept by value, sorted by offset and covering the object without holes, so
+ * the page of an offset is found by binary search. A random access pattern leaves tens
+ * of thousands of pages behind, which a linear walk would visit on every read.
  */
 class ObjectPageList {
 public:
     friend class DataCacheEntity;
-    typedef std::list<ObjectPage *> self_type;
+    typedef std::vector<ObjectPage> self_type;
 
     static void free_list(self_type &list);
 
@@ -118,33 +122,63 @@ public:
     bool find_unloaded_pate(off_t start, off_t &ret_start, size_t &ret_size) const;
     size_t get_total_unloaded_page_size(off_t start=0, size_t size=0) const;
     int get_unloaded_pages(self_type &unloaded_list, off_t start=0, size_t size=0) const;
-    bool serialize(StatCacheFile &file, bool is_output);
+    // etag and last_modified of the object version the pages were loaded from, they are
+    // stored with the pages on output and returned on input
+    bool serialize(StatCacheFile &file, bool is_output, std::string &etag,
+            int64_t &last_modified);
     void dump();
 
 private:
+    enum {
+        STAT_MAGIC = 0x31435342,    // "BSC1"
+        STAT_VERSION = 1
+    };
+    // loaded ranges follow the header and etag as pairs of uint64 offset and bytes,
+    // everything between them is unloaded
+    struct StatHeader {
+        uint32_t magic;
+        uint32_t version;
+        uint64_t size;
+        int64_t last_modified;
+        uint32_t etag_size;
+        uint32_t range_count;
+        uint32_t checksum;          // of everything after the header
+        uint32_t reserved;
+    };
+
     void clear();
-    bool compress();
-    bool parse(off_t new_pos);
+    // index of the page containing pos, size of list if there is none
+    size_t find_page(off_t pos) const;
+    // merge page at index with its neighbours in the same loaded state
+    void compress(size_t index);
+    // split the page containing pos, return index of the page starting at pos
+    size_t parse(off_t new_pos);
 
 private:
     self_type  _pages;
 };
 
+/**
+ * Page list of a cache file, kept in a tree of its own below the cache dir. It is
+ * replaced as a whole through rename, so readers never see a partly written one and
+ * need no lock.
+ */
 class StatCacheFile {
 public:
     explicit StatCacheFile(DataCache *data_cache, const char *path=NULL);
     ~StatCacheFile();
 
+    // open for reading, false if there is none
     bool open_file();
     bool release();
-    bool set_path(const char *path, bool is_open=true);
+    bool set_path(const char *path, bool is_open=false);
+    // replace content with data
+    bool write_file(const std::string &data);
     int get_fd() const
     {
         return _fd;
     }
 
-private:
-
 private:
     DataCache *_data_cache;
     std::string _path;
@@ -213,6 +247,10 @@ public:
     bool set_gid(gid_t gid);
     bool set_content_type(const char *path);
     void set_xattr(const std::string &xattr);
+    // the object got a new version of the same content, such as by a copy onto itself
+    // which replaced its meta. data loaded from old_etag is kept for it
+    void rebase_version(const std::string &old_etag, const std::string &etag,
+            time_t last_modified);
 
     int load(off_t start=0, size_t size=0);
 
@@ -224,8 +262,27 @@ public:
     int truncate(off_t size);
 
 private:
+    // unit in which loaded data of a file is aged and freed
+    enum {
+        EVICT_BLOCK_SIZE = 4 * 1024 * 1024,
+        EVICT_MIN_BLOCKS = 16,
+        // share of loaded data freed at once, so few reads pay for picking cold blocks
+        EVICT_BATCH_PERCENT = 10
+    };
+
     static int fill_file(int fd, unsigned char byte, size_t size, off_t start);
+    // whether size bytes more may be loaded, within free disk space and cache capacity.
+    // past capacity cold files other than this one are evicted first
+    bool make_cache_space(size_t size);
+    // record an access to the blocks of [start, start + size)
+    void touch_blocks(off_t start, size_t size);
+    // punch out least recently read blocks outside [start, start + size) worth at least
+    // size bytes, or a batch of loaded data if more, and mark them unloaded. false if
+    // nothing could be freed
+    bool free_cold_blocks(off_t start, size_t size);
     void clear();
+    // write page list to stat file along with etag of _origin_meta
+    bool save_stat();
     int open_mirror_file();
     bool set_all_status(bool is_loaded);
     bool set_all_status_unloaded()
@@ -256,6 +313,10 @@ private:
     // indicate that the local cache file is opened by tmpfile and will be removed on close
     bool _is_tmpfile;
     std::string _tmp_filename;
+
+    // last read of every block by _access_seq, 0 for never
+    std::vector<uint64_t> _block_access;
+    uint64_t _access_seq;
 };
 
 class DataCache {
@@ -294,6 +355,38 @@ public:
     int set_cache_dir(const std::string &dir);
     bool delete_cache_dir();
     int delete_cache_file(const char *path);
+    // drop local data of path, or of everything below it if subtree is set, so it is
+    // downloaded again. files open now keep theirs
+    void invalidate(const char *path, bool subtree);
+    // bytes of cache dir to keep, 0 for no limit
+    void set_capacity(int64_t capacity) {
+        _evictor.set_capacity(capacity);
+    }
+    int64_t capacity() const {
+        return _evictor.capacity();
+    }
+    int start_eviction() {
+        return _evictor.start();
+    }
+    void stop_eviction() {
+        _evictor.stop();
+    }
+    void eviction_stats(CacheEvictorStats *stats) {
+        _evictor.stats(stats);
+    }
+    int64_t cached_bytes_except(const std::string &path) {
+        return _evictor.bytes_except(path);
+    }
+    // delete local data of path unless it is open, return -EBUSY if it is. without wait
+    // -EAGAIN is returned instead of waiting for the lock of data cache
+    int evict(const std::string &path, bool wait=true);
+    // evict cold files other than path until bytes are freed, return bytes freed
+    int64_t free_space(int64_t bytes, const std::string &path) {
+        return _evictor.free_space(bytes, path);
+    }
+    // same as DataCacheEntity::rebase_version() for path, open or not
+    void rebase_version(const char *path, const std::string &old_etag,
+            const std::string &etag, time_t last_modified);
     bool make_cache_path(const char *path, std::string &cache_path,
             bool is_create_dir=true, bool is_mirror_path=false);
     bool check_cache_top_dir();
@@ -314,6 +407,11 @@ public:
     bool make_path(const char *path, std::string &file_path, bool is_create_dir=true);
 
 private:
+    void invalidate_dir(const std::string &path, const std::string &cache_dir);
+    void delete_unless_open(const std::string &path);
+    // account bytes of a cache file just closed
+    void update_evictor(const char *path);
+
     BosfsUtil *_bosfs_util;
     FileManager *_file_manager;
     pthread_mutex_t _data_cache_lock;
@@ -321,6 +419,7 @@ private:
     std::string _cache_dir;
     std::string _tmp_dir;
     size_t _free_disk_space;
+    CacheEvictor _evictor;
 };
 
 END_FS_NAMESPACE
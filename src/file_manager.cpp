@@ -13,179 +13,966 @@
 #include "bosfs_lib/bosfs_lib.h"
 #include "file_manager.h"
 #include "bosfs_util.h"
+#include <time.h>
 #include <algorithm>
+#include <map>
 
 BEGIN_FS_NAMESPACE
 
+// compatible with old user meta which not has "bosfs-" prefix
+static const std::string *find_user_meta(const bcesdk_ns::ObjectMetaData &meta,
+        const char *key, const char *old_key) {
+    const std::string *value = &meta.user_meta(key);
+    if (value->empty()) {
+        value = &meta.user_meta(old_key);
+    }
+    return value->empty() ? NULL : value;
+}
+
+MetaSnapshot::MetaSnapshot()
+    : _mtime(0), _uid(0), _gid(0), _mode(0), _flags(0), _is_dir_type(false),
+      _is_partial(true), _memory_bytes(sizeof(MetaSnapshot)) {
+}
+
+MetaSnapshot::MetaSnapshot(const bcesdk_ns::ObjectMetaData &meta, bool is_partial)
+    : _mtime(0), _uid(0), _gid(0), _mode(0), _flags(0), _is_dir_type(false),
+      _is_partial(is_partial) {
+    _meta.copy_from(meta);
+    const std::string *value = find_user_meta(meta, "bosfs-mtime", "mtime");
+    if (value != NULL) {
+        _mtime = strtol(value->c_str(), NULL, 0);
+        _flags |= HAS_MTIME;
+    }
+    value = find_user_meta(meta, "bosfs-uid", "uid");
+    if (value != NULL) {
+        _uid = strtol(value->c_str(), NULL, 0);
+        _flags |= HAS_UID;
+    }
+    value = find_user_meta(meta, "bosfs-gid", "gid");
+    if (value != NULL) {
+        _gid = strtol(value->c_str(), NULL, 0);
+        _flags |= HAS_GID;
+    }
+    value = find_user_meta(meta, "bosfs-mode", "mode");
+    if (value != NULL) {
+        _mode = strtol(value->c_str(), NULL, 0);
+        _flags |= HAS_MODE;
+    }
+    const std::string &content_type = meta.content_type();
+    if (!content_type.empty()) {
+        _is_dir_type = content_type.substr(0, content_type.find(';'))
+            == "application/x-directory";
+    }
+    // an estimate, system headers other than these are few and short
+    _memory_bytes = sizeof(MetaSnapshot) + meta.etag().size() + content_type.size();
+    const std::map<std::string, std::string> &user_meta = meta.user_meta();
+    for (std::map<std::string, std::string>::const_iterator it = user_meta.begin();
+            it != user_meta.end(); ++it) {
+        _memory_bytes += 4 * sizeof(void *) + it->first.size() + it->second.size();
+    }
+}
+
+const MetaSnapshotPtr &MetaSnapshot::empty() {
+    static MetaSnapshotPtr s_empty = make_ref<MetaSnapshot>();
+    return s_empty;
+}
+
 int File::load_meta_from_bos() {
-    MutexGuard lock(&_mutex);
-    int ret = _bosfs_util->head_object(_name.substr(1), &_meta, &_is_dir_obj, &_is_prefix);
+    bcesdk_ns::ObjectMetaData meta;
+    int ret = _bosfs_util->head_object(_name.substr(1), &meta, &_is_dir_obj, &_is_prefix);
     if (ret == 0) {
+        set_meta(meta);
         _load_time_s = get_system_time_s();
     }
     return ret;
 }
 
-// compatible with old user meta which not has "bosfs-" prefix
-int File::stat(struct stat *st) {
-    MutexGuard lock(&_mutex);
-    _bosfs_util->init_default_stat(st);
+void File::set_from_summary(const bcesdk_ns::ObjectSummary &summary) {
+    bcesdk_ns::ObjectMetaData meta;
+    meta.set_content_length(summary.size);
+    meta.set_etag(summary.etag);
+    meta.set_last_modified(summary.last_modified);
+    // a directory object is known by its key, its type is right even before a HEAD
+    _is_dir_obj = !summary.key.empty() && *summary.key.rbegin() == '/';
+    set_meta(meta, true);
+    _is_provisional = true;
+}
+
+void File::update_stat() {
+    const BosfsOptions &options = _bosfs_util->options();
+    _stat.uid = options.is_bosfs_uid ? options.bosfs_uid : options.mount_uid;
+    _stat.gid = options.is_bosfs_gid ? options.bosfs_gid : options.mount_gid;
+    _stat.mode = options.mount_mode;
+    _stat.mtime = 0;
     if (_name == "/" || _is_prefix) {
-        st->st_size = ST_BLKSIZE;
-        st->st_blocks = ST_MINBLOCKS;
-        return 0;
+        _stat.size = ST_BLKSIZE;
+        _stat.blocks = ST_MINBLOCKS;
+        _stat.use_mount_time = true;
+        return;
     }
-    st->st_size = _meta.content_length();
-    st->st_blocks = (st->st_size + st->st_blksize - 1) / st->st_blksize * ST_MINBLOCKS;
-    const std::string *meta_mtime = &_meta.user_meta("bosfs-mtime");
-    if (meta_mtime->empty()) {
-        meta_mtime = &_meta.user_meta("mtime");
+    const MetaSnapshot &meta = *_snapshot;
+    _stat.use_mount_time = false;
+    _stat.size = meta.content_length();
+    _stat.blocks = (_stat.size + ST_BLKSIZE - 1) / ST_BLKSIZE * ST_MINBLOCKS;
+    _stat.mtime = meta.has_mtime() ? meta.mtime() : meta.last_modified();
+    if (meta.has_uid()) {
+        _stat.uid = meta.uid();
     }
-    if (meta_mtime->empty()) {
-        st->st_mtime = _meta.last_modified();
-    } else {
-        st->st_mtime = strtol(meta_mtime->c_str(), NULL, 0);
-    }
-    st->st_ctime = st->st_mtime;
-    st->st_atime = st->st_mtime;
-    const std::string *meta_uid = &_meta.user_meta("bosfs-uid");
-    if (meta_uid->empty()) {
-        meta_uid = &_meta.user_meta("uid");
-    }
-    if (!meta_uid->empty()) {
-        st->st_uid = strtol(meta_uid->c_str(), NULL, 0);
-    }
-    const std::string *meta_gid = &_meta.user_meta("bosfs-gid");
-    if (meta_gid->empty()) {
-        meta_gid = &_meta.user_meta("gid");
-    }
-    if (!meta_gid->empty()) {
-        st->st_gid = strtol(meta_gid->c_str(), NULL, 0);
-    }
-    bool is_dir = false;
-    std::string content_type = _meta.content_type();
-    if (_is_dir_obj && _meta.content_length() == 0) {
-        is_dir = true;
-    } else if (!content_type.empty()) {
-        content_type = content_type.substr(0, content_type.find(';'));
-        is_dir = (content_type == "application/x-directory");
-    }
-    st->st_mode = _bosfs_util->options().mount_mode;
-    const std::string *meta_mode = &_meta.user_meta("bosfs-mode");
-    if (meta_mode->empty()) {
-        meta_mode = &_meta.user_meta("mode");
-    }
-    if (!meta_mode->empty()) {
-        st->st_mode = strtol(meta_mode->c_str(), NULL, 0);
-        if (!(st->st_mode & S_IFMT)) {//前四位表示文件类型
-            st->st_mode |= is_dir ? S_IFDIR : S_IFREG;
+    if (meta.has_gid()) {
+        _stat.gid = meta.gid();
+    }
+    bool is_dir = (_is_dir_obj && meta.content_length() == 0) || meta.is_dir_type();
+    if (meta.has_mode()) {
+        _stat.mode = meta.mode();
+        if (!(_stat.mode & S_IFMT)) {//前四位表示文件类型
+            _stat.mode |= is_dir ? S_IFDIR : S_IFREG;
         }
     } else {
         if (!is_dir) {
-            st->st_mode &= ~(S_IFMT | 0111);//低三位
-            st->st_mode |= S_IFREG;
+            _stat.mode &= ~(S_IFMT | 0111);//低三位
+            _stat.mode |= S_IFREG;
         }
     }
+}
+
+int File::stat(struct stat *st) const {
+    memset(st, 0, sizeof(struct stat));
+    st->st_nlink = 1;
+    st->st_blksize = ST_BLKSIZE;
+    st->st_size = _stat.size;
+    st->st_blocks = _stat.blocks;
+    st->st_uid = _stat.uid;
+    st->st_gid = _stat.gid;
+    st->st_mode = _stat.mode;
+    if (_stat.use_mount_time) {
+        st->st_mtime = _bosfs_util->options().mount_time;
+        st->st_ctime = st->st_mtime;
+    } else {
+        st->st_mtime = _stat.mtime;
+        st->st_ctime = _stat.mtime;
+        st->st_atime = _stat.mtime;
+    }
     return 0;
 }
 
-int FileManager::get(const std::string &name, FilePtr *file) {
+FileManager::FileManager(BosfsUtil *bosfs_util)
+    : _bosfs_util(bosfs_util), _expire_s(-1), _max_stale_s(0), _size(0), _bytes(0),
+      _cache_capacity(-1), _shard_capacity(0), _shard_memory_limit(0), _negative_expire_s(0),
+      _negative_shard_capacity(0),
+      _negative_generation(0), _dir_expire_s(0), _subtree_generation(0), _coalesced_count(0),
+      _bg_running(false), _kernel_cache(false) {
+    for (int i = 0; i < DIR_GENERATION_SLOTS; ++i) {
+        _dir_generations[i] = 0;
+    }
+    pthread_mutex_init(&_bg_mutex, NULL);
+    pthread_cond_init(&_bg_cond, NULL);
+}
+
+FileManager::~FileManager() {
+    stop();
+    pthread_cond_destroy(&_bg_cond);
+    pthread_mutex_destroy(&_bg_mutex);
+}
+
+void FileManager::set_cache_capacity(int cap) {
+    _cache_capacity = cap;
+    _shard_capacity = cap > 0 ? (cap + SHARD_NUM - 1) / SHARD_NUM : 0;
+}
+
+void FileManager::set_memory_limit(int64_t bytes) {
+    _shard_memory_limit = bytes > 0 ? (bytes + SHARD_NUM - 1) / SHARD_NUM : 0;
+}
+
+void FileManager::set_negative_capacity(int cap) {
+    _negative_shard_capacity = cap > 0 ? (cap + SHARD_NUM - 1) / SHARD_NUM : 0;
+}
+
+int FileManager::open_snapshot(const std::string &path, const std::string &root) {
+    int ret = _snapshot.open(path, root);
+    if (ret == 0) {
+        _expire_s = -1;
+    }
+    return ret;
+}
+
+int FileManager::start() {
+    MutexGuard lock(&_bg_mutex);
+    if (_bg_running) {
+        return 0;
+    }
+    int ret = pthread_create(&_bg_thread, NULL, background_thread, this);
+    if (ret != 0) {
+        BOSFS_ERR("failed to start file manager background thread, errno: %d", ret);
+        return -ret;
+    }
+    _bg_running = true;
+    return 0;
+}
+
+void FileManager::stop() {
+    {
+        MutexGuard lock(&_bg_mutex);
+        if (!_bg_running) {
+            return;
+        }
+        _bg_running = false;
+        pthread_cond_signal(&_bg_cond);
+    }
+    pthread_join(_bg_thread, NULL);
+    _meta_store.flush();
+}
+
+void *FileManager::background_thread(void *arg) {
+    reinterpret_cast<FileManager *>(arg)->background_loop();
+    return NULL;
+}
+
+void FileManager::background_loop() {
+    int64_t last_gc_s = get_system_time_s();
+    MutexGuard lock(&_bg_mutex);
+    while (_bg_running) {
+        if (_invalidate_pending.empty()) {
+            struct timespec deadline;
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_sec += 1;
+            pthread_cond_timedwait(&_bg_cond, &_bg_mutex, &deadline);
+        }
+        if (!_bg_running) {
+            break;
+        }
+        if (!_invalidate_pending.empty()) {
+            std::vector<std::string> pending;
+            pending.swap(_invalidate_pending);
+            pthread_mutex_unlock(&_bg_mutex);
+            for (size_t i = 0; i < pending.size(); ++i) {
+                _bosfs_util->invalidate_kernel_cache(pending[i]);
+            }
+            pthread_mutex_lock(&_bg_mutex);
+        }
+        // records of misses are appended here, off their way
+        pthread_mutex_unlock(&_bg_mutex);
+        _meta_store.flush();
+        pthread_mutex_lock(&_bg_mutex);
+        if (!_refresh_pending.empty()) {
+            std::unordered_map<std::string, int64_t> pending;
+            pending.swap(_refresh_pending);
+            pthread_mutex_unlock(&_bg_mutex);
+            for (std::unordered_map<std::string, int64_t>::iterator it = pending.begin();
+                    it != pending.end(); ++it) {
+                refresh(it->first, it->second);
+            }
+            pthread_mutex_lock(&_bg_mutex);
+        }
+        // nothing expires if neither positive nor negative entries have a ttl
+        int ttl = _negative_expire_s > 0 ? _negative_expire_s : _expire_s;
+        if (_expire_s >= 0) {
+            ttl = std::min(ttl, _expire_s);
+        }
+        if (_dir_expire_s > 0) {
+            ttl = ttl < 0 ? _dir_expire_s : std::min(ttl, _dir_expire_s);
+        }
+        if (ttl < 0) {
+            continue;
+        }
+        int64_t now = get_system_time_s();
+        // half of expire time is fine enough, but never sweep more than once a second
+        int64_t interval = std::max(1, std::min(ttl / 2, 60));
+        if (now - last_gc_s < interval) {
+            continue;
+        }
+        last_gc_s = now;
+        pthread_mutex_unlock(&_bg_mutex);
+        gc();
+        _meta_store.compact();
+        BOSFS_DEBUG("file manager has %zu entries in %zu bytes", (size_t) _size,
+                (size_t) _bytes);
+        pthread_mutex_lock(&_bg_mutex);
+    }
+}
+
+int FileManager::get(const std::string &name, FilePtr *file, bool need_user_meta) {
+    bool upgrade = false;
+    Shard &shard = shard_of(name);
+    if (_snapshot.is_open()) {
+        // snapshot is complete and has user meta of every entry, nothing to coalesce
+        if (try_get(name, file)) {
+            return 0;
+        }
+        *file = make_ref<File>(_bosfs_util, name);
+        if (!_snapshot.load(file->get())) {
+            return -ENOENT;
+        }
+        insert(shard, name, *file, false, file, 0);
+        return 0;
+    }
     if (try_get(name, file)) {
+        if (!need_user_meta || !(*file)->is_provisional()) {
+            return 0;
+        }
+        upgrade = true;
+    } else if (is_negative(shard, name) || is_absent_from_listing(name)) {
+        return -ENOENT;
+    }
+    // concurrent misses on one name wait for the first of them to load it
+    FlightPtr flight;
+    if (!join_flight(shard, name, &flight)) {
+        ++_coalesced_count;
+        int ret = wait_flight(flight, file);
+        if (ret != 0 || !need_user_meta || !(*file)->is_provisional()) {
+            return ret;
+        }
+        // the shared result may be a provisional entry cached meanwhile
+        return load(shard, name, true, file);
+    }
+    int ret = load(shard, name, upgrade, file);
+    finish_flight(shard, name, flight, ret, *file);
+    return ret;
+}
+
+int FileManager::load(Shard &shard, const std::string &name, bool upgrade, FilePtr *file) {
+    *file = make_ref<File>(_bosfs_util, name);
+    if (!upgrade && _meta_store.load(file->get())) {
+        insert(shard, name, *file, false, file, 0);
         return 0;
     }
-    file->reset(new File(_bosfs_util, name));
     int ret = (*file)->load_meta_from_bos();
     if (ret != 0) {
         if (ret == BOSFS_OBJECT_NOT_EXIST) {
+            if (upgrade) {
+                del(name);
+            }
+            add_negative(shard, name);
             return -ENOENT;
         }
         return -EIO;
     }
-    size_t size = 0;
+    _meta_store.put(**file);
+    // another thread may have loaded the same name meanwhile, keep the first one unless
+    // it is the provisional one being upgraded
+    insert(shard, name, *file, upgrade, upgrade ? NULL : file, 0);
+    return 0;
+}
+
+bool FileManager::join_flight(Shard &shard, const std::string &name, FlightPtr *flight) {
+    bcesdk_ns::TLSLockWriteGuard lock(shard.lock);
+    FlightTable::iterator it = shard.flights.find(name);
+    if (it != shard.flights.end()) {
+        *flight = it->second;
+        return false;
+    }
+    *flight = make_ref<Flight>();
+    shard.flights.insert(FlightTable::value_type(name, *flight));
+    return true;
+}
+
+int FileManager::wait_flight(FlightPtr &flight, FilePtr *file) {
+    MutexGuard lock(&flight->mutex);
+    while (!flight->done) {
+        pthread_cond_wait(&flight->cond, &flight->mutex);
+    }
+    *file = flight->file;
+    return flight->ret;
+}
+
+void FileManager::finish_flight(Shard &shard, const std::string &name, FlightPtr &flight,
+        int ret, const FilePtr &file) {
+    {
+        bcesdk_ns::TLSLockWriteGuard lock(shard.lock);
+        shard.flights.erase(name);
+    }
+    MutexGuard lock(&flight->mutex);
+    flight->done = true;
+    flight->ret = ret;
+    flight->file = file;
+    pthread_cond_broadcast(&flight->cond);
+}
+
+bool FileManager::try_get(const std::string &name, FilePtr *file) {
+    int64_t now = get_system_time_s();
+    Shard &shard = shard_of(name);
+    bool need_refresh = false;
+    bool expired = false;
     {
-        bcesdk_ns::TLSLockWriteGuard lock(_lock);
-        FileTable::iterator it = _table.find(name);
-        if (it != _table.end()) {
-            *file = it->second;
+        bcesdk_ns::TLSLockReadGuard lock(shard.lock);
+        FileTable::iterator it = shard.table.find(name);
+        if (it == shard.table.end()) {
+            return false;
+        }
+        FilePtr &found = it->second->file;
+        if (!is_expired(found, now) || found.refcount() > 1) {
+            found->hit(now);
+            *file = found;
+            need_refresh = wants_refresh(found, now);
         } else {
-            _table[name] = *file;
+            expired = true;
         }
-        size = _table.size();
     }
-    if (_cache_capacity > 0 && size > (size_t) _cache_capacity) {
-        gc();
+    if (!expired) {
+        if (need_refresh) {
+            schedule_refresh(name, (*file)->load_time_s());
+        }
+        return true;
     }
-    return 0;
+    // expired and nobody else holds it, upgrade to write lock to drop it
+    if (erase_if_unused(shard, name, 1)) {
+        return false;
+    }
+    // raced with a writer, the entry is either gone or being used again
+    return try_get(name, file);
 }
 
-bool FileManager::try_get(const std::string &name, FilePtr *file) {
+void FileManager::schedule_refresh(const std::string &name, int64_t load_time_s) {
+    MutexGuard lock(&_bg_mutex);
+    if (!_bg_running || _refresh_pending.size() >= MAX_REFRESH_PENDING) {
+        return;
+    }
+    if (_refresh_pending.insert(std::make_pair(name, load_time_s)).second) {
+        pthread_cond_signal(&_bg_cond);
+    }
+}
+
+void FileManager::invalidate_kernel(const std::string &name) {
+    if (!_kernel_cache) {
+        return;
+    }
+    MutexGuard lock(&_bg_mutex);
+    if (!_bg_running) {
+        return;
+    }
+    _invalidate_pending.push_back(name);
+    pthread_cond_signal(&_bg_cond);
+}
+
+void FileManager::refresh(const std::string &name, int64_t load_time_s) {
+    FilePtr file = make_ref<File>(_bosfs_util, name);
+    int ret = file->load_meta_from_bos();
+    if (ret == BOSFS_OBJECT_NOT_EXIST) {
+        del(name);
+        add_negative(shard_of(name), name);
+        return;
+    }
+    if (ret != 0) {
+        // keep serving the stale entry, it is retried on next hit until max stale time
+        return;
+    }
+    Shard &shard = shard_of(name);
+    bool changed = false;
+    bool access_changed = false;
+    {
+        bcesdk_ns::TLSLockWriteGuard lock(shard.lock);
+        FileTable::iterator it = shard.table.find(name);
+        // dropped or replaced by a newer state meanwhile
+        if (it == shard.table.end() || it->second->file->load_time_s() != load_time_s) {
+            return;
+        }
+        ClockEntry &entry = *it->second;
+        struct stat old_st;
+        struct stat new_st;
+        entry.file->stat(&old_st);
+        file->stat(&new_st);
+        changed = old_st.st_size != new_st.st_size || old_st.st_mtime != new_st.st_mtime
+            || old_st.st_mode != new_st.st_mode || old_st.st_uid != new_st.st_uid
+            || old_st.st_gid != new_st.st_gid;
+        access_changed = is_access_changed(entry.file, file);
+        size_t bytes = entry_bytes(name, file);
+        shard.bytes = shard.bytes - entry.bytes + bytes;
+        _bytes += bytes;
+        _bytes -= entry.bytes;
+        entry.bytes = bytes;
+        entry.file = file;
+    }
+    _meta_store.put(*file);
+    // changed on bos behind our back
+    if (changed) {
+        invalidate_kernel(name);
+    }
+    if (access_changed) {
+        _bosfs_util->invalidate_access_cache();
+    }
+}
+
+void FileManager::set(const std::string &name, FilePtr &file, bool created) {
+    int listed = 0;
+    if (created) {
+        bump_dir_generation(name);
+        listed = file->is_prefix() || file->is_dir_obj() ? LISTED_DIR : LISTED_FILE;
+    }
+    _meta_store.erase(name);
+    insert(shard_of(name), name, file, true, NULL, listed);
+}
+
+void FileManager::del(const std::string &name) {
+    // name may have been created or removed, listing of its parent is no longer trusted
+    bump_dir_generation(name);
+    _meta_store.erase(name);
+    Shard &shard = shard_of(name);
+    std::vector<std::string> unlinked;
+    {
+        bcesdk_ns::TLSLockReadGuard tree_lock(_tree_lock);
+        {
+            bcesdk_ns::TLSLockWriteGuard lock(shard.lock);
+            shard.negatives.erase(name);
+            FileTable::iterator it = shard.table.find(name);
+            if (it != shard.table.end()) {
+                erase_locked(shard, it->second, &unlinked);
+            }
+        }
+        unlink_all(unlinked);
+        mark_parent_incomplete(name);
+    }
+    // kernel may look names up again before it returns, no tree lock is held then
+    invalidate_kernel(name);
+}
+
+void FileManager::del_subtree(const std::string &name) {
+    bump_dir_generation(name);
+    ++_subtree_generation;
+    _meta_store.erase_subtree(name);
+    std::vector<std::string> pending(1, name);
+    std::vector<std::string> unlinked;
+    {
+        // exclusive, no insert may link to a node between it is dropped here and its
+        // children are unlinked below
+        bcesdk_ns::TLSLockWriteGuard tree_lock(_tree_lock);
+        while (!pending.empty()) {
+            std::string cur;
+            cur.swap(pending.back());
+            pending.pop_back();
+            Shard &shard = shard_of(cur);
+            bcesdk_ns::TLSLockWriteGuard lock(shard.lock);
+            shard.negatives.erase(cur);
+            FileTable::iterator it = shard.table.find(cur);
+            if (it != shard.table.end()) {
+                erase_locked(shard, it->second, &unlinked);
+            }
+            DirTable::iterator node = shard.dirs.find(cur);
+            if (node == shard.dirs.end()) {
+                continue;
+            }
+            DirChildren &children = node->second.children;
+            for (DirChildren::iterator child = children.begin(); child != children.end();
+                    ++child) {
+                if (child->second.refs > 0) {
+                    pending.push_back(join_path(cur, child->first));
+                }
+            }
+            shard.dirs.erase(node);
+            unlinked.push_back(cur);
+        }
+        // unlinks from nodes dropped above find nothing and are ignored
+        unlink_all(unlinked);
+        mark_parent_incomplete(name);
+    }
+    invalidate_negatives();
+    invalidate_kernel(name);
+}
+
+void FileManager::insert(Shard &shard, const std::string &name, const FilePtr &file,
+        bool replace, FilePtr *result, int listed) {
+    // link before the entry becomes visible and unlink after it is gone, so parent never
+    // counts less references than there are entries
+    bcesdk_ns::TLSLockReadGuard tree_lock(_tree_lock);
+    adjust_parent(name, 1, listed);
     int64_t now = get_system_time_s();
-    bcesdk_ns::TLSLockReadGuard lock(_lock);
-    FileTable::iterator it = _table.find(name);
-    if (it == _table.end()) {
+    std::vector<std::string> unlinked;
+    bool access_changed = false;
+    {
+        bcesdk_ns::TLSLockWriteGuard lock(shard.lock);
+        shard.negatives.erase(name);
+        std::pair<FileTable::iterator, bool> ret = shard.table.insert(
+                FileTable::value_type(name, shard.ring.end()));
+        if (!ret.second) {
+            if (replace) {
+                ClockEntry &entry = *ret.first->second;
+                access_changed = is_access_changed(entry.file, file);
+                size_t bytes = entry_bytes(name, file);
+                shard.bytes = shard.bytes - entry.bytes + bytes;
+                _bytes += bytes;
+                _bytes -= entry.bytes;
+                entry.bytes = bytes;
+                entry.file = file;
+            } else if (result != NULL) {
+                *result = ret.first->second->file;
+            }
+            unlinked.push_back(name);
+        } else {
+            // new entry goes right behind the hand, so it is the last one to be swept
+            ret.first->second = shard.ring.insert(shard.hand,
+                    ClockEntry(&ret.first->first, file, now));
+            ret.first->second->bytes = entry_bytes(name, file);
+            shard.bytes += ret.first->second->bytes;
+            _bytes += ret.first->second->bytes;
+            ++_size;
+        }
+        while (is_over_capacity(shard)) {
+            if (!evict_locked(shard, now, &unlinked)) {
+                break;
+            }
+        }
+    }
+    unlink_all(unlinked);
+    if (access_changed) {
+        _bosfs_util->invalidate_access_cache();
+    }
+}
+
+bool FileManager::is_access_changed(const FilePtr &old_file, const FilePtr &new_file) {
+    // provisional mode and owner are those of the mount, no verdict is built on them
+    if (old_file->is_provisional()) {
         return false;
     }
-    if (_expire_s >= 0 && (it->second->load_time_s() + _expire_s) < now) {
-        if (it->second.refcount() <= 1) {
-            _table.erase(it);
+    struct stat old_st;
+    struct stat new_st;
+    old_file->stat(&old_st);
+    new_file->stat(&new_st);
+    return (S_ISDIR(old_st.st_mode) || S_ISDIR(new_st.st_mode))
+        && (old_st.st_mode != new_st.st_mode || old_st.st_uid != new_st.st_uid
+            || old_st.st_gid != new_st.st_gid);
+}
+
+bool FileManager::erase_if_unused(Shard &shard, const std::string &name, int max_refcount) {
+    int64_t now = get_system_time_s();
+    std::vector<std::string> unlinked;
+    bcesdk_ns::TLSLockReadGuard tree_lock(_tree_lock);
+    {
+        bcesdk_ns::TLSLockWriteGuard lock(shard.lock);
+        FileTable::iterator it = shard.table.find(name);
+        if (it == shard.table.end()) {
+            return false;
+        }
+        FilePtr &found = it->second->file;
+        if (!is_expired(found, now) || found.refcount() > max_refcount) {
             return false;
         }
+        erase_locked(shard, it->second, &unlinked);
     }
-    it->second->hit(now);
-    *file = it->second;
+    unlink_all(unlinked);
     return true;
 }
 
-void FileManager::set(const std::string &name, FilePtr &file) {
-    size_t size = 0;
-    {
-        bcesdk_ns::TLSLockWriteGuard lock(_lock);
-        _table[name] = file;
-        size = _table.size();
+bool FileManager::is_negative(Shard &shard, const std::string &name) {
+    if (_negative_expire_s <= 0) {
+        return false;
     }
-    if (_cache_capacity > 0 && size > (size_t) _cache_capacity) {
-        gc();
+    int64_t now = get_system_time_s();
+    bcesdk_ns::TLSLockReadGuard lock(shard.lock);
+    NegativeTable::iterator it = shard.negatives.find(name);
+    return it != shard.negatives.end() && is_negative_valid(it->second, now);
+}
+
+void FileManager::add_negative(Shard &shard, const std::string &name) {
+    if (_negative_expire_s <= 0) {
+        return;
+    }
+    int64_t now = get_system_time_s();
+    bcesdk_ns::TLSLockWriteGuard lock(shard.lock);
+    if (_negative_shard_capacity > 0 && shard.negatives.size() >= _negative_shard_capacity) {
+        for (NegativeTable::iterator it = shard.negatives.begin(); it != shard.negatives.end();) {
+            if (is_negative_valid(it->second, now)) {
+                ++it;
+            } else {
+                it = shard.negatives.erase(it);
+            }
+        }
+        // still full of valid entries, any one of them is as good as another to drop
+        if (shard.negatives.size() >= _negative_shard_capacity) {
+            shard.negatives.erase(shard.negatives.begin());
+        }
     }
+    NegativeEntry &entry = shard.negatives[name];
+    entry.time_s = now;
+    entry.generation = _negative_generation;
 }
 
-void FileManager::del(const std::string &name) {
-    bcesdk_ns::TLSLockWriteGuard lock(_lock);
-    _table.erase(name);
+bool FileManager::split_path(const std::string &name, std::string *dir, std::string *base) {
+    size_t pos = name.rfind('/');
+    if (pos == std::string::npos || name == "/") {
+        return false;
+    }
+    *dir = pos == 0 ? "/" : name.substr(0, pos);
+    *base = name.substr(pos + 1);
+    return true;
 }
 
-void FileManager::gc() {
+std::string FileManager::join_path(const std::string &dir, const std::string &base) {
+    return dir == "/" ? dir + base : dir + "/" + base;
+}
+
+bool FileManager::is_absent_from_listing(const std::string &name) {
+    std::string dir;
+    std::string base;
+    if (_dir_expire_s <= 0 || !split_path(name, &dir, &base)) {
+        return false;
+    }
+    int64_t now = get_system_time_s();
+    Shard &shard = shard_of(dir);
+    bcesdk_ns::TLSLockReadGuard lock(shard.lock);
+    DirTable::iterator node = shard.dirs.find(dir);
+    if (node == shard.dirs.end() || !is_dir_fresh(node->second, now)) {
+        return false;
+    }
+    DirChildren::iterator child = node->second.children.find(base);
+    return child == node->second.children.end() || child->second.listed == 0;
+}
+
+bool FileManager::get_dir_children(const std::string &dir, DirEntryList *children) {
+    if (_snapshot.is_open()) {
+        return _snapshot.list(dir, children);
+    }
+    if (_dir_expire_s <= 0) {
+        return false;
+    }
     int64_t now = get_system_time_s();
-    std::vector<FilePtr> candis;
-    std::vector<FilePtr> removes;
+    Shard &shard = shard_of(dir);
+    bcesdk_ns::TLSLockReadGuard lock(shard.lock);
+    DirTable::iterator node = shard.dirs.find(dir);
+    if (node == shard.dirs.end() || !is_dir_fresh(node->second, now)) {
+        return false;
+    }
+    const DirChildren &all = node->second.children;
+    for (DirChildren::const_iterator it = all.begin(); it != all.end(); ++it) {
+        if (it->second.listed != 0) {
+            children->push_back(DirEntry(it->first, it->second.listed & LISTED_DIR));
+        }
+    }
+    return true;
+}
+
+void FileManager::set_dir_children(const std::string &dir, const DirEntryList &children,
+        uint64_t generation) {
+    if (_dir_expire_s <= 0) {
+        return;
+    }
+    int64_t now = get_system_time_s();
+    Shard &shard = shard_of(dir);
+    bool created = false;
+    bcesdk_ns::TLSLockReadGuard tree_lock(_tree_lock);
     {
-        bcesdk_ns::TLSLockReadGuard lock(_lock);
-        for (FileTable::iterator it = _table.begin(); it != _table.end(); ++it) {
-            if (_expire_s >= 0 && (it->second->load_time_s() + _expire_s) < now) {
-                removes.push_back(it->second);
+        bcesdk_ns::TLSLockWriteGuard lock(shard.lock);
+        // checked under lock, a mutation bumps generation before it takes this lock to
+        // update the listing, so it either shows up here or sees the listing complete
+        if (generation != dir_generation(dir)) {
+            return;
+        }
+        DirTable::iterator node = shard.dirs.find(dir);
+        if (node == shard.dirs.end()) {
+            node = shard.dirs.insert(DirTable::value_type(dir, DirNode())).first;
+            created = true;
+        }
+        DirChildren &all = node->second.children;
+        for (DirChildren::iterator it = all.begin(); it != all.end(); ++it) {
+            it->second.listed = 0;
+        }
+        for (size_t i = 0; i < children.size(); ++i) {
+            all[children[i].name].listed = children[i].is_dir ? LISTED_DIR : LISTED_FILE;
+        }
+        for (DirChildren::iterator it = all.begin(); it != all.end();) {
+            if (it->second.listed == 0 && it->second.refs <= 0) {
+                it = all.erase(it);
             } else {
-                candis.push_back(it->second);
+                ++it;
+            }
+        }
+        node->second.complete = true;
+        node->second.list_time_s = now;
+    }
+    if (created) {
+        adjust_parent(dir, 1, 0);
+    }
+}
+
+void FileManager::bump_dir_generation(const std::string &name) {
+    std::string dir;
+    std::string base;
+    if (split_path(name, &dir, &base)) {
+        ++_dir_generations[std::hash<std::string>()(dir) % DIR_GENERATION_SLOTS];
+    }
+}
+
+void FileManager::adjust_parent(const std::string &name, int delta, int listed) {
+    std::string child = name;
+    std::string dir;
+    std::string base;
+    while (delta != 0 && split_path(child, &dir, &base)) {
+        Shard &shard = shard_of(dir);
+        int next = 0;
+        {
+            bcesdk_ns::TLSLockWriteGuard lock(shard.lock);
+            DirTable::iterator node = shard.dirs.find(dir);
+            if (node == shard.dirs.end()) {
+                // parent was dropped by del_subtree, nothing to unlink from
+                if (delta < 0) {
+                    return;
+                }
+                node = shard.dirs.insert(DirTable::value_type(dir, DirNode())).first;
+                next = 1;
+            }
+            DirChildren &all = node->second.children;
+            DirChildren::iterator it = all.find(base);
+            if (it == all.end()) {
+                if (delta < 0) {
+                    return;
+                }
+                it = all.insert(DirChildren::value_type(base, DirChild())).first;
             }
+            it->second.refs += delta;
+            if (node->second.complete) {
+                it->second.listed |= listed;
+            }
+            if (it->second.refs <= 0 && it->second.listed == 0) {
+                all.erase(it);
+                if (shrink_node_locked(shard.dirs, node)) {
+                    next = -1;
+                }
+            }
+        }
+        child.swap(dir);
+        delta = next;
+        listed = 0;
+    }
+}
+
+void FileManager::unlink_all(const std::vector<std::string> &names) {
+    for (size_t i = 0; i < names.size(); ++i) {
+        adjust_parent(names[i], -1, 0);
+    }
+}
+
+void FileManager::mark_parent_incomplete(const std::string &name) {
+    std::string dir;
+    std::string base;
+    if (!split_path(name, &dir, &base)) {
+        return;
+    }
+    Shard &shard = shard_of(dir);
+    {
+        bcesdk_ns::TLSLockWriteGuard lock(shard.lock);
+        DirTable::iterator node = shard.dirs.find(dir);
+        if (node == shard.dirs.end() || !node->second.complete) {
+            return;
+        }
+        if (!forget_listing_locked(shard.dirs, node)) {
+            return;
         }
     }
-    if (_cache_capacity >= 0 && candis.size() > (size_t) _cache_capacity) {
-        std::sort(candis.begin(), candis.end(), compare_cache_priority);
-        for (size_t i = _cache_capacity; i < candis.size(); ++i) {
-            removes.push_back(candis[i]);
+    adjust_parent(dir, -1, 0);
+}
+
+bool FileManager::forget_listing_locked(DirTable &dirs, DirTable::iterator node) {
+    node->second.complete = false;
+    DirChildren &all = node->second.children;
+    for (DirChildren::iterator it = all.begin(); it != all.end();) {
+        it->second.listed = 0;
+        if (it->second.refs <= 0) {
+            it = all.erase(it);
+        } else {
+            ++it;
         }
     }
-    candis.clear();
+    return shrink_node_locked(dirs, node);
+}
+
+bool FileManager::shrink_node_locked(DirTable &dirs, DirTable::iterator node) {
+    if (node->second.complete || !node->second.children.empty()) {
+        return false;
+    }
+    dirs.erase(node);
+    return true;
+}
+
+void FileManager::erase_locked(Shard &shard, ClockRing::iterator node,
+        std::vector<std::string> *unlinked) {
+    unlinked->push_back(*node->name);
+    shard.bytes -= node->bytes;
+    _bytes -= node->bytes;
+    shard.table.erase(*node->name);
+    if (shard.hand == node) {
+        shard.hand = shard.ring.erase(node);
+    } else {
+        shard.ring.erase(node);
+    }
+    --_size;
+}
 
-    for (size_t i = 0; i < removes.size(); ++i) {
-        bcesdk_ns::TLSLockWriteGuard lock(_lock);
-        FileTable::iterator it = _table.find(removes[i]->name());
-        if (it == _table.end()) {
+bool FileManager::evict_locked(Shard &shard, int64_t now, std::vector<std::string> *unlinked) {
+    // every entry can be skipped at most MAX_CLOCK_CREDIT times before it runs out of
+    // credit, so one more round than that is enough unless everything is in use
+    size_t steps = shard.ring.size() * (MAX_CLOCK_CREDIT + 1);
+    while (steps-- > 0 && !shard.ring.empty()) {
+        if (shard.hand == shard.ring.end()) {
+            shard.hand = shard.ring.begin();
+        }
+        ClockEntry &entry = *shard.hand;
+        if (entry.file.refcount() > 1) {
+            ++shard.hand;
             continue;
         }
-        if (it->second.refcount() > 2) {
+        if (!is_expired(entry.file, now)) {
+            if (entry.file->hit_time_s() > entry.scan_time_s) {
+                entry.credit = std::min(entry.file->hit_count(), (int) MAX_CLOCK_CREDIT);
+                entry.scan_time_s = now;
+            }
+            if (entry.credit > 0) {
+                --entry.credit;
+                ++shard.hand;
+                continue;
+            }
+        }
+        erase_locked(shard, shard.hand, unlinked);
+        return true;
+    }
+    return false;
+}
+
+void FileManager::stats(FileManagerStats *stats) {
+    *stats = FileManagerStats();
+    for (int i = 0; i < SHARD_NUM; ++i) {
+        Shard &shard = _shards[i];
+        bcesdk_ns::TLSLockReadGuard lock(shard.lock);
+        stats->entries += shard.table.size();
+        stats->bytes += shard.bytes;
+        stats->negatives += shard.negatives.size();
+        stats->dirs += shard.dirs.size();
+    }
+    stats->coalesced = _coalesced_count;
+}
+
+void FileManager::gc() {
+    std::vector<std::string> unlinked;
+    bcesdk_ns::TLSLockReadGuard tree_lock(_tree_lock);
+    for (int i = 0; i < SHARD_NUM; ++i) {
+        int64_t now = get_system_time_s();
+        Shard &shard = _shards[i];
+        bcesdk_ns::TLSLockWriteGuard lock(shard.lock);
+        for (NegativeTable::iterator it = shard.negatives.begin(); it != shard.negatives.end();) {
+            if (is_negative_valid(it->second, now)) {
+                ++it;
+            } else {
+                it = shard.negatives.erase(it);
+            }
+        }
+        // stale listings are forgotten, nodes are kept as long as they have children
+        for (DirTable::iterator it = shard.dirs.begin(); it != shard.dirs.end();) {
+            DirTable::iterator node = it++;
+            if (!node->second.complete || is_dir_fresh(node->second, now)) {
+                continue;
+            }
+            std::string dir = node->first;
+            if (forget_listing_locked(shard.dirs, node)) {
+                unlinked.push_back(dir);
+            }
+        }
+        if (_expire_s < 0) {
             continue;
         }
-        _table.erase(it);
+        for (ClockRing::iterator it = shard.ring.begin(); it != shard.ring.end();) {
+            ClockRing::iterator node = it++;
+            if (is_expired(node->file, now) && node->file.refcount() <= 1) {
+                erase_locked(shard, node, &unlinked);
+            }
+        }
     }
+    unlink_all(unlinked);
 }
 
 END_FS_NAMESPACE
@@ -13,8 +13,17 @@
 #ifndef BAIDU_BOS_BOSFS_SRC_FILE_MANAGER_H
 #define BAIDU_BOS_BOSFS_SRC_FILE_MANAGER_H
 
+#include <algorithm>
+#include <atomic>
+#include <functional>
+#include <list>
+#include <unordered_map>
+#include <vector>
+
 #include "common.h"
 #include "util.h"
+#include "meta_store.h"
+#include "namespace_snapshot.h"
 #include "bcesdk/bos/client.h"
 #include "bcesdk/util/lock.h"
 
@@ -22,53 +31,135 @@ BEGIN_FS_NAMESPACE
 
 class BosfsUtil;
 
+// immutable meta of an object, parsed once when it is loaded and shared by pointer
+// between a File and its readers. the meta is kept as it came, so an update can be
+// built from it without losing headers this mount does not parse
+class MetaSnapshot {
+public:
+    MetaSnapshot();
+    // partial is set if meta does not carry every header of the object, e.g. it is
+    // taken from a listing or the meta store
+    MetaSnapshot(const bcesdk_ns::ObjectMetaData &meta, bool is_partial);
+
+    // snapshot of an empty meta, shared by prefixes and files not loaded yet
+    static const RefPtr<MetaSnapshot> &empty();
+
+    int64_t content_length() const { return _meta.content_length(); }
+    time_t last_modified() const { return _meta.last_modified(); }
+    const std::string &etag() const { return _meta.etag(); }
+    const std::string &content_type() const { return _meta.content_type(); }
+    bool is_dir_type() const { return _is_dir_type; }
+    bool is_partial() const { return _is_partial; }
+
+    // parsed from user meta, compatible with old keys which not have "bosfs-" prefix
+    bool has_mtime() const { return _flags & HAS_MTIME; }
+    time_t mtime() const { return _mtime; }
+    bool has_uid() const { return _flags & HAS_UID; }
+    uid_t uid() const { return _uid; }
+    bool has_gid() const { return _flags & HAS_GID; }
+    gid_t gid() const { return _gid; }
+    bool has_mode() const { return _flags & HAS_MODE; }
+    mode_t mode() const { return _mode; }
+
+    // empty if key is absent
+    const std::string &user_meta(const std::string &key) const { return _meta.user_meta(key); }
+    const bcesdk_ns::ObjectMetaData &meta() const { return _meta; }
+    void to_meta(bcesdk_ns::ObjectMetaData *meta) const { meta->copy_from(_meta); }
+
+    size_t memory_bytes() const { return _memory_bytes; }
+
+private:
+    enum { HAS_MTIME = 1, HAS_UID = 2, HAS_GID = 4, HAS_MODE = 8 };
+
+    bcesdk_ns::ObjectMetaData _meta;
+    time_t _mtime;
+    uid_t _uid;
+    gid_t _gid;
+    mode_t _mode;
+    uint8_t _flags;
+    bool _is_dir_type;
+    bool _is_partial;
+    size_t _memory_bytes;
+};
+typedef RefPtr<MetaSnapshot> MetaSnapshotPtr;
+
 class File {
 public:
     File(BosfsUtil *bosfs_util, const std::string &name)
         : _bosfs_util(bosfs_util), _name(name), _is_dir_obj(false), _is_prefix(false),
-          _hit_time_s(0), _hit_bit(0) {
-        pthread_mutex_init(&_mutex, NULL);
+          _is_provisional(false), _snapshot(MetaSnapshot::empty()), _hit_time_s(0),
+          _hit_bit(0) {
         _load_time_s = get_system_time_s();
         hit(_load_time_s);
-    }
-    ~File() {
-        pthread_mutex_destroy(&_mutex);
+        update_stat();
     }
 
     const std::string &name() const { return _name; }
 
-    void set_is_dir_obj(bool is_dir_obj) { _is_dir_obj = is_dir_obj; }
+    void set_is_dir_obj(bool is_dir_obj) {
+        _is_dir_obj = is_dir_obj;
+        update_stat();
+    }
     bool is_dir_obj() const { return _is_dir_obj; }
 
-    void set_is_prefix(bool is_prefix) { _is_prefix = is_prefix; }
+    void set_is_prefix(bool is_prefix) {
+        _is_prefix = is_prefix;
+        update_stat();
+    }
     bool is_prefix() const { return _is_prefix; }
 
-    bcesdk_ns::ObjectMetaData &meta() { return _meta; }
-    const bcesdk_ns::ObjectMetaData &meta() const { return _meta; }
+    // meta from a listing is provisional: it has no content type and user meta, so
+    // uid/gid/mode are those of the mount and a symlink looks like a regular file. it
+    // is good for readdir only and upgraded by a HEAD before attributes are handed out
+    void set_from_summary(const bcesdk_ns::ObjectSummary &summary);
+    bool is_provisional() const { return _is_provisional; }
 
-    int64_t load_time_s() const { return _load_time_s; }
+    // meta is only set before the file is published to FileManager, it never changes
+    // afterwards, so readers share the snapshot without locking
+    void set_meta(const bcesdk_ns::ObjectMetaData &meta, bool is_partial = false) {
+        _snapshot = make_ref<MetaSnapshot>(meta, is_partial);
+        update_stat();
+    }
+    const MetaSnapshotPtr &snapshot() const { return _snapshot; }
 
-    pthread_mutex_t &mutex() { return _mutex; }
+    int64_t load_time_s() const { return _load_time_s; }
+    void set_load_time_s(int64_t load_time_s) { _load_time_s = load_time_s; }
 
-    int64_t hit_time_s() const { return _hit_time_s; }
+    int64_t hit_time_s() const { return _hit_time_s.load(std::memory_order_relaxed); }
 
+    // never blocks, a hit racing with the thread moving the window to a new second may
+    // be lost, which is fine for the heuristics built on it
     void hit(int64_t now) {
-        MutexGuard lock(&_mutex);
         int n = now % 64;
-        if (now - _hit_time_s >= 64) {
-            _hit_bit = 0;
-        } else {
-            int h = _hit_time_s % 64;
-            uint64_t h_mask = (1UL << h);
-            h_mask = (h_mask - 1) | h_mask;
-            uint64_t n_mask = -1UL ^ ((1UL << n) - 1);
-            _hit_bit &= h > n ? h_mask & n_mask : h_mask | n_mask;
+        uint64_t bit = 1UL << n;
+        int64_t last = _hit_time_s.load(std::memory_order_relaxed);
+        if (now <= last) {
+            // hot entries mostly end here without writing the shared cache line
+            if (last - now < 64 && !(_hit_bit.load(std::memory_order_relaxed) & bit)) {
+                _hit_bit.fetch_or(bit, std::memory_order_relaxed);
+            }
+            return;
+        }
+        if (!_hit_time_s.compare_exchange_strong(last, now, std::memory_order_relaxed)) {
+            // another thread moved the window on
+            _hit_bit.fetch_or(bit, std::memory_order_relaxed);
+            return;
         }
-        _hit_bit |= 1UL << n;
-        _hit_time_s = now;
+        if (now - last >= 64) {
+            _hit_bit.store(bit, std::memory_order_relaxed);
+            return;
+        }
+        // clear seconds passed since last hit, bit n is kept by both masks
+        int h = last % 64;
+        uint64_t h_mask = (1UL << h);
+        h_mask = (h_mask - 1) | h_mask;
+        uint64_t n_mask = -1UL ^ (bit - 1);
+        _hit_bit.fetch_and(h > n ? h_mask & n_mask : h_mask | n_mask,
+                std::memory_order_relaxed);
+        _hit_bit.fetch_or(bit, std::memory_order_relaxed);
     }
     int hit_count() const {
-        uint64_t bits = _hit_bit;
+        uint64_t bits = _hit_bit.load(std::memory_order_relaxed);
         int count = 0;
         while (bits != 0) {
             ++count;
@@ -77,61 +168,361 @@ public:
         return count;
     }
 
+    // heap bytes held by this file, the shared empty snapshot is not counted
+    size_t memory_bytes() const {
+        size_t bytes = sizeof(File) + _name.capacity();
+        if (_snapshot.get() != MetaSnapshot::empty().get()) {
+            bytes += _snapshot->memory_bytes();
+        }
+        return bytes;
+    }
+
     int load_meta_from_bos();
-    int stat(struct stat *st);
+    // a copy of the stat template, only mount time is taken from options at call time
+    int stat(struct stat *st) const;
 
 private:
+    // resolve stat fields from meta and mount options, called whenever they change,
+    // which is only before the file is published
+    void update_stat();
+
+    // packed result of update_stat()
+    struct StatTemplate {
+        int64_t size;
+        int64_t blocks;
+        time_t mtime;
+        uid_t uid;
+        gid_t gid;
+        mode_t mode;
+        bool use_mount_time;    // root and prefixes have no mtime of their own
+    };
+
     BosfsUtil *_bosfs_util;
     std::string _name;
     bool _is_dir_obj;
     bool _is_prefix;
-    bcesdk_ns::ObjectMetaData _meta;
+    bool _is_provisional;
+    MetaSnapshotPtr _snapshot;
+    StatTemplate _stat;
 
     int64_t _load_time_s;
-    pthread_mutex_t _mutex;
 
-    int64_t _hit_time_s;
-    uint64_t _hit_bit;
+    std::atomic<int64_t> _hit_time_s;
+    std::atomic<uint64_t> _hit_bit;   // seconds hit in the 64 seconds up to _hit_time_s
 };
 
-typedef SharedPtr<File> FilePtr;
-typedef std::map<std::string, FilePtr> FileTable;
+typedef RefPtr<File> FilePtr;
+
+// a child in directory listing, is_dir for common prefixes and directory objects
+struct DirEntry {
+    DirEntry() : is_dir(false) {}
+    DirEntry(const std::string &n, bool d) : name(n), is_dir(d) {}
+    std::string name;
+    bool is_dir;
+};
+typedef std::vector<DirEntry> DirEntryList;
+
+struct FileManagerStats {
+    FileManagerStats() : entries(0), bytes(0), negatives(0), dirs(0), coalesced(0) {}
+    size_t entries;
+    size_t bytes;       // estimated heap bytes of cached entries
+    size_t negatives;
+    size_t dirs;
+    uint64_t coalesced;
+};
 
 class FileManager {
 public:
-    static bool compare_cache_priority(const FilePtr &a, const FilePtr &b) {
-        int c1 = a->hit_count();
-        int c2 = b->hit_count();
-        if (c1 == c2) {
-            return a->hit_time_s() < b->hit_time_s();
-        }
-        return c1 > c2;
-    }
+    FileManager(BosfsUtil *bosfs_util);
+    ~FileManager();
 
-public:
-    FileManager(BosfsUtil *bosfs_util)
-        : _bosfs_util(bosfs_util), _expire_s(-1), _cache_capacity(-1) {
-    }
-    ~FileManager() {
-    }
     void set_expire_s(int seconds) { _expire_s = seconds; }
-    void set_cache_capacity(int cap) { _cache_capacity = cap; }
+    int expire_s() const { return _expire_s; }
+    void set_cache_capacity(int cap);
+    // evict entries once their estimated size exceeds given bytes, 0 for no limit
+    void set_memory_limit(int64_t bytes);
+    // remember nonexistent names for given seconds, 0 to disable
+    void set_negative_expire_s(int seconds) { _negative_expire_s = seconds; }
+    void set_negative_capacity(int cap);
+    // serve complete directory listings for given seconds, 0 to disable
+    void set_dir_expire_s(int seconds) { _dir_expire_s = seconds; }
+    int dir_expire_s() const { return _dir_expire_s; }
+    // serve entries for given seconds past expire time while refreshing them in
+    // background, 0 to disable
+    void set_max_stale_s(int seconds) { _max_stale_s = seconds; }
 
-    int get(const std::string &name, FilePtr *file);
+    // ask kernel to drop its entry and attributes of every name changed or dropped here,
+    // needed once kernel is allowed to cache them
+    void set_kernel_cache(bool enabled) { _kernel_cache = enabled; }
+
+    // keep meta loaded from bos in a log at path, so it survives remounts
+    int open_meta_store(const std::string &path) { return _meta_store.open(path, _expire_s); }
+    // serve the whole namespace from a snapshot and never ask bos for meta, root is the
+    // real path of mount point. entries no longer expire, an evicted one is simply read
+    // from snapshot again
+    int open_snapshot(const std::string &path, const std::string &root);
+    bool has_snapshot() const { return _snapshot.is_open(); }
+
+    // start/stop the background worker which expires entries, must be called after
+    // fuse daemonized, threads do not survive fork()
+    int start();
+    void stop();
+
+    // a provisional entry is replaced by a HEAD if need_user_meta is set
+    int get(const std::string &name, FilePtr *file, bool need_user_meta = false);
+    // replace the cached entry of name by a HEAD, for callers which need every header
+    // and have found a partial snapshot
+    int upgrade(const std::string &name, FilePtr *file) {
+        return load(shard_of(name), name, true, file);
+    }
 
     bool try_get(const std::string &name, FilePtr *file);
-    void set(const std::string &name, FilePtr &file);
+    // created is true if name has just been created by us, so it joins the listing of
+    // its parent instead of invalidating it
+    void set(const std::string &name, FilePtr &file, bool created = false);
     void del(const std::string &name);
+    // cache file unless name is cached already, for preloading
+    void add(const std::string &name, FilePtr &file) {
+        insert(shard_of(name), name, file, false, NULL, 0);
+    }
+    // true if adding more entries would evict others
+    bool is_full() const {
+        return (_cache_capacity > 0 && _size >= (size_t) _cache_capacity)
+            || (_shard_memory_limit > 0 && _bytes >= _shard_memory_limit * SHARD_NUM);
+    }
+
+    // forget all nonexistent names, used when a whole subtree has changed
+    void invalidate_negatives() { ++_negative_generation; }
+
+    // drop name and every cached entry below it, costs O(cached entries in subtree)
+    void del_subtree(const std::string &name);
+
+    // take before listing dir, its listing is only recorded if no child of it was
+    // created or removed and no subtree was dropped since then. counters are shared by
+    // directories hashing to the same slot, which only costs a listing now and then.
+    // both only grow, so their sum changes whenever either does
+    uint64_t dir_generation(const std::string &dir) const {
+        return _dir_generations[std::hash<std::string>()(dir) % DIR_GENERATION_SLOTS]
+            + _subtree_generation;
+    }
+    // record a complete listing of directory, base names of children only
+    void set_dir_children(const std::string &dir, const DirEntryList &children,
+            uint64_t generation);
+    // return false if there is no complete and fresh listing of directory
+    bool get_dir_children(const std::string &dir, DirEntryList *children);
 
+    // drop all expired entries which are not in use
     void gc();
 
+    size_t size() const { return _size; }
+    size_t memory_bytes() const { return _bytes; }
+    void stats(FileManagerStats *stats);
+    // number of misses which waited for a lookup of the same name instead of their own
+    uint64_t coalesced_count() const { return _coalesced_count; }
+
+private:
+    // names are spread over independently locked shards, so lookups of different
+    // paths never contend on the same lock
+    enum { SHARD_NUM = 64 };
+    // max times an entry can be passed over by the clock hand without a new hit
+    enum { MAX_CLOCK_CREDIT = 3 };
+    enum { REFRESH_MIN_HITS = 2, MAX_REFRESH_PENDING = 1024 };
+    enum { DIR_GENERATION_SLOTS = 1024 };
+
+    // each shard keeps its entries in a ring swept by a clock hand (GCLOCK), an entry
+    // hit since the last sweep gets credit from its hit_count, and is evicted when the
+    // hand finds it with no credit left
+    struct ClockEntry {
+        ClockEntry(const std::string *n, const FilePtr &f, int64_t now)
+            : name(n), file(f), credit(0), scan_time_s(now), bytes(0) {
+        }
+        const std::string *name;
+        FilePtr file;
+        int credit;
+        int64_t scan_time_s;
+        size_t bytes;
+    };
+    typedef std::list<ClockEntry> ClockRing;
+    typedef std::unordered_map<std::string, ClockRing::iterator> FileTable;
+
+    struct NegativeEntry {
+        int64_t time_s;
+        uint64_t generation;
+    };
+    typedef std::unordered_map<std::string, NegativeEntry> NegativeTable;
+
+    // every cached entry is linked into the node of its parent directory, so a subtree
+    // can be walked without scanning all shards; a node also holds the latest complete
+    // listing of the directory
+    enum { LISTED_FILE = 1, LISTED_DIR = 2 };
+    struct DirChild {
+        DirChild() : listed(0), refs(0) {}
+        int listed;     // LISTED_* bits, set by listing or local creation
+        int refs;       // number of cached entries and nodes of this child
+    };
+    typedef std::unordered_map<std::string, DirChild> DirChildren;
+    struct DirNode {
+        DirNode() : complete(false), list_time_s(0) {}
+        DirChildren children;
+        bool complete;
+        int64_t list_time_s;
+    };
+    typedef std::unordered_map<std::string, DirNode> DirTable;
+
+    // a lookup of name sent to bos, others missing the same name wait for its result
+    struct Flight {
+        Flight() : done(false), ret(0) {
+            pthread_mutex_init(&mutex, NULL);
+            pthread_cond_init(&cond, NULL);
+        }
+        ~Flight() {
+            pthread_cond_destroy(&cond);
+            pthread_mutex_destroy(&mutex);
+        }
+        pthread_mutex_t mutex;
+        pthread_cond_t cond;
+        bool done;
+        int ret;
+        FilePtr file;
+    };
+    typedef RefPtr<Flight> FlightPtr;
+    typedef std::unordered_map<std::string, FlightPtr> FlightTable;
+
+    struct Shard {
+        Shard() : hand(ring.end()), bytes(0) {}
+        bcesdk_ns::TLSLock lock;
+        FileTable table;
+        ClockRing ring;
+        ClockRing::iterator hand;
+        NegativeTable negatives;
+        DirTable dirs;
+        FlightTable flights;
+        size_t bytes;
+    };
+
+    Shard &shard_of(const std::string &name) {
+        return _shards[std::hash<std::string>()(name) % SHARD_NUM];
+    }
+    // an entry costs its file, its key, a table node and a ring node
+    static size_t entry_bytes(const std::string &name, const FilePtr &file) {
+        return sizeof(FileTable::value_type) + sizeof(ClockEntry) + 4 * sizeof(void *)
+            + name.capacity() + file->memory_bytes();
+    }
+    bool is_over_capacity(const Shard &shard) const {
+        return (_shard_capacity > 0 && shard.table.size() > _shard_capacity)
+            || (_shard_memory_limit > 0 && shard.bytes > _shard_memory_limit);
+    }
+    // an entry past expire time is still served up to max stale time while it is
+    // being refreshed, it is gone only after that
+    bool is_expired(const FilePtr &file, int64_t now) const {
+        return _expire_s >= 0 && (file->load_time_s() + _expire_s + _max_stale_s) < now;
+    }
+    // stale entries, and hot ones which are about to expire, are refreshed in background
+    bool wants_refresh(const FilePtr &file, int64_t now) const {
+        if (_expire_s < 0 || _max_stale_s <= 0) {
+            return false;
+        }
+        int64_t age = now - file->load_time_s();
+        int ahead = std::max(1, _expire_s / 4);
+        return age > _expire_s ||
+            (age + ahead > _expire_s && file->hit_count() >= REFRESH_MIN_HITS);
+    }
+    // insert or replace under shard write lock, evict from the shard if it is full
+    void insert(Shard &shard, const std::string &name, const FilePtr &file, bool replace,
+            FilePtr *result, int listed);
+    bool erase_if_unused(Shard &shard, const std::string &name, int max_refcount);
+    // search permission verdicts of BosfsUtil are built on mode and owner of directories,
+    // true if replacing old_file by new_file changes either
+    static bool is_access_changed(const FilePtr &old_file, const FilePtr &new_file);
+    bool is_negative(Shard &shard, const std::string &name);
+    void add_negative(Shard &shard, const std::string &name);
+    void schedule_refresh(const std::string &name, int64_t load_time_s);
+    // kernel is told by background worker, invalidating from inside a fuse operation
+    // may deadlock on locks kernel holds for it
+    void invalidate_kernel(const std::string &name);
+    // reload name, and replace the cached entry if it is still the one loaded at load_time_s
+    void refresh(const std::string &name, int64_t load_time_s);
+    // load name from meta store or bos and cache it
+    int load(Shard &shard, const std::string &name, bool upgrade, FilePtr *file);
+    // return true if caller is the first to miss name and has to finish the flight
+    bool join_flight(Shard &shard, const std::string &name, FlightPtr *flight);
+    int wait_flight(FlightPtr &flight, FilePtr *file);
+    void finish_flight(Shard &shard, const std::string &name, FlightPtr &flight, int ret,
+            const FilePtr &file);
+
+    static bool split_path(const std::string &name, std::string *dir, std::string *base);
+    static std::string join_path(const std::string &dir, const std::string &base);
+    bool is_dir_fresh(const DirNode &node, int64_t now) const {
+        return node.complete && _dir_expire_s > 0 && node.list_time_s + _dir_expire_s >= now;
+    }
+    // a complete listing of parent proves that name does not exist
+    bool is_absent_from_listing(const std::string &name);
+    // a child of the parent of name is created or removed
+    void bump_dir_generation(const std::string &name);
+    // add delta references from parent node to name and set listed bits if parent is
+    // complete, creating or dropping nodes up the tree as needed. refs is a plain counter
+    // so links and unlinks may arrive in any order. never called with a shard lock held,
+    // since parent lives in another shard. callers hold _tree_lock shared, so nodes
+    // never vanish under them with references left
+    void adjust_parent(const std::string &name, int delta, int listed);
+    void unlink_all(const std::vector<std::string> &names);
+    void mark_parent_incomplete(const std::string &name);
+    // drop a node if nothing refers to it, return true if dropped
+    static bool shrink_node_locked(DirTable &dirs, DirTable::iterator node);
+    // mark a node incomplete and clear its listing, return true if the node is dropped
+    static bool forget_listing_locked(DirTable &dirs, DirTable::iterator node);
+
+    // following functions must be called with shard write lock held, names which need
+    // to be unlinked from their parent are appended to unlinked
+    void erase_locked(Shard &shard, ClockRing::iterator node,
+            std::vector<std::string> *unlinked);
+    bool evict_locked(Shard &shard, int64_t now, std::vector<std::string> *unlinked);
+    bool is_negative_valid(const NegativeEntry &entry, int64_t now) const {
+        return entry.generation == _negative_generation &&
+            entry.time_s + _negative_expire_s >= now;
+    }
+
+    static void *background_thread(void *arg);
+    void background_loop();
+
 private:
     BosfsUtil *_bosfs_util;
-    bcesdk_ns::TLSLock _lock;
     int _expire_s;
+    int _max_stale_s;
 
-    FileTable _table;
+    Shard _shards[SHARD_NUM];
+    std::atomic<size_t> _size;
+    std::atomic<size_t> _bytes;
     int _cache_capacity;
+    size_t _shard_capacity;
+    size_t _shard_memory_limit;
+
+    int _negative_expire_s;
+    size_t _negative_shard_capacity;
+    std::atomic<uint64_t> _negative_generation;
+
+    int _dir_expire_s;
+    std::atomic<uint64_t> _dir_generations[DIR_GENERATION_SLOTS];
+    std::atomic<uint64_t> _subtree_generation;
+    // taken before any shard lock: shared by everything linking entries to their parent
+    // nodes or unlinking them, exclusive by del_subtree() which drops nodes still
+    // referenced. otherwise an insert could re-create a node just dropped, and the
+    // unlinks of the dropped subtree would then take its references away
+    bcesdk_ns::TLSLock _tree_lock;
+
+    MetaStore _meta_store;
+    NamespaceSnapshot _snapshot;
+    std::atomic<uint64_t> _coalesced_count;
+
+    pthread_t _bg_thread;
+    bool _bg_running;
+    bool _kernel_cache;
+    // name to load time of entries to refresh, protected by _bg_mutex
+    std::unordered_map<std::string, int64_t> _refresh_pending;
+    // names to invalidate in kernel, protected by _bg_mutex
+    std::vector<std::string> _invalidate_pending;
+    pthread_mutex_t _bg_mutex;
+    pthread_cond_t _bg_cond;
 };
 
 END_FS_NAMESPACE
@@ -0,0 +1,137 @@
+/**
+ * bosfs - A fuse-based file system implemented on Baidu Object Storage(BOS)
+ *
+ * Copyright (c) 2016 Baidu.com, Inc. All rights reserved.
+ *
+ * @file    invalidation_listener.cpp
+ * @brief   receives invalidations of paths changed by other nodes over a local socket
+ **/
+#include <errno.h>
+#include <poll.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include <vector>
+
+#include "invalidation_listener.h"
+#include "bosfs_impl.h"
+
+BEGIN_FS_NAMESPACE
+
+InvalidationListener::InvalidationListener(BosfsImpl *bosfs_impl)
+    : _bosfs_impl(bosfs_impl), _fd(-1), _running(false) {
+}
+
+InvalidationListener::~InvalidationListener() {
+    stop();
+}
+
+int InvalidationListener::start(const std::string &socket_path) {
+    if (_fd >= 0) {
+        return 0;
+    }
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    if (socket_path.size() >= sizeof(addr.sun_path)) {
+        BOSFS_ERR("invalidation socket path %s is too long", socket_path.c_str());
+        return -ENAMETOOLONG;
+    }
+    addr.sun_family = AF_UNIX;
+    memcpy(addr.sun_path, socket_path.c_str(), socket_path.size());
+    int fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        int err = errno;
+        BOSFS_ERR("could not create invalidation socket, errno(%d)", err);
+        return -err;
+    }
+    // left over by a previous mount
+    unlink(socket_path.c_str());
+    if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) != 0
+            || chmod(socket_path.c_str(), S_IRUSR | S_IWUSR) != 0) {
+        int err = errno;
+        BOSFS_ERR("could not bind invalidation socket %s, errno(%d)", socket_path.c_str(), err);
+        close(fd);
+        unlink(socket_path.c_str());
+        return -err;
+    }
+    _fd = fd;
+    _socket_path = socket_path;
+    _running = true;
+    int ret = pthread_create(&_thread, NULL, listen_thread, this);
+    if (ret != 0) {
+        BOSFS_ERR("failed to start invalidation listener thread, errno: %d", ret);
+        _running = false;
+        close(_fd);
+        _fd = -1;
+        unlink(_socket_path.c_str());
+        return -ret;
+    }
+    BOSFS_INFO("listening for invalidations on %s", socket_path.c_str());
+    return 0;
+}
+
+void InvalidationListener::stop() {
+    if (_fd < 0) {
+        return;
+    }
+    _running = false;
+    pthread_join(_thread, NULL);
+    close(_fd);
+    _fd = -1;
+    unlink(_socket_path.c_str());
+}
+
+void *InvalidationListener::listen_thread(void *arg) {
+    reinterpret_cast<InvalidationListener *>(arg)->listen_loop();
+    return NULL;
+}
+
+void InvalidationListener::listen_loop() {
+    std::vector<char> buf(MAX_MESSAGE_SIZE);
+    while (_running) {
+        struct pollfd pfd;
+        pfd.fd = _fd;
+        pfd.events = POLLIN;
+        pfd.revents = 0;
+        // wake up now and then to see if we are stopped
+        if (poll(&pfd, 1, POLL_INTERVAL_MS) <= 0) {
+            continue;
+        }
+        ssize_t n = recv(_fd, &buf[0], buf.size(), 0);
+        if (n <= 0) {
+            continue;
+        }
+        size_t pos = 0;
+        while (pos < (size_t) n) {
+            const char *begin = &buf[pos];
+            const char *end = (const char *) memchr(begin, '\n', n - pos);
+            size_t len = end != NULL ? end - begin : n - pos;
+            if (len > 0) {
+                handle(std::string(begin, len));
+            }
+            pos += len + 1;
+        }
+    }
+}
+
+void InvalidationListener::handle(const std::string &line) {
+    size_t sp = line.find(' ');
+    std::string op = line.substr(0, sp);
+    std::string path = sp != std::string::npos ? line.substr(sp + 1) : "";
+    if (path.empty() || path[0] != '/') {
+        BOSFS_WARN("ignored invalidation: %s", line.c_str());
+        return;
+    }
+    if (op == "path") {
+        _bosfs_impl->invalidate(path.c_str());
+    } else if (op == "prefix") {
+        _bosfs_impl->invalidate_prefix(path.c_str());
+    } else {
+        BOSFS_WARN("ignored invalidation: %s", line.c_str());
+    }
+}
+
+END_FS_NAMESPACE
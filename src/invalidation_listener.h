@@ -0,0 +1,53 @@
+/**
+ * bosfs - A fuse-based file system implemented on Baidu Object Storage(BOS)
+ *
+ * Copyright (c) 2016 Baidu.com, Inc. All rights reserved.
+ *
+ * @file    invalidation_listener.h
+ * @brief   receives invalidations of paths changed by other nodes over a local socket
+ **/
+#ifndef BAIDU_BOS_BOSFS_INVALIDATION_LISTENER_H
+#define BAIDU_BOS_BOSFS_INVALIDATION_LISTENER_H
+
+#include <pthread.h>
+
+#include <atomic>
+#include <string>
+
+#include "common.h"
+
+BEGIN_FS_NAMESPACE
+
+class BosfsImpl;
+
+// a unix datagram socket, every datagram holds one or more lines of
+//   path <path>        forget meta and local data of path
+//   prefix <path>      same for path and everything below it
+// paths are relative to mountpoint like those of fuse. socket is only accessible to the
+// user who mounted
+class InvalidationListener {
+public:
+    explicit InvalidationListener(BosfsImpl *bosfs_impl);
+    ~InvalidationListener();
+
+    // must be called after fuse daemonized, threads do not survive fork()
+    int start(const std::string &socket_path);
+    void stop();
+
+private:
+    enum { MAX_MESSAGE_SIZE = 65536, POLL_INTERVAL_MS = 1000 };
+
+    static void *listen_thread(void *arg);
+    void listen_loop();
+    void handle(const std::string &line);
+
+    BosfsImpl *_bosfs_impl;
+    std::string _socket_path;
+    int _fd;
+    std::atomic<bool> _running;
+    pthread_t _thread;
+};
+
+END_FS_NAMESPACE
+
+#endif
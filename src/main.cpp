@@ -135,13 +135,44 @@ static void init_bos_args() {
     s_bos_args["bos.fs.multipart_parallel"] = BosfsConfItem("multipart_parallel", "limit the client maximum multipart parallel requests send to the server, default is 10");
     s_bos_args["bos.fs.cache.base"] = BosfsConfItem("use_cache",
             "cache directory in absolute path");
+    s_bos_args["bos.fs.cache.capacity"] = BosfsConfItem("cache_capacity",
+            "number, can use unit KB,MB", "how many bytes cache directory may take, cold files are evicted beyond that, default is 0 (no limit)");
     s_bos_args["bos.fs.meta.expires"] = BosfsConfItem("meta_expires",
             "seconds", "after how many seconds the local meta will be expired, default is infinite");
     s_bos_args["bos.fs.meta.capacity"] = BosfsConfItem("meta_capacity",
             "integer number", "how many meta cache items will be keeped as a hit, default is 100000");
+    s_bos_args["bos.fs.meta.memory_limit"] = BosfsConfItem("meta_memory_limit",
+            "number, can use unit KB,MB", "how much memory meta cache items may take, evicted beyond that, default is 0 (no limit)");
+    s_bos_args["bos.fs.meta.negative_expires"] = BosfsConfItem("meta_negative_expires",
+            "seconds", "after how many seconds a nonexistent path will be looked up again, default is 0 (disabled)");
+    s_bos_args["bos.fs.meta.negative_capacity"] = BosfsConfItem("meta_negative_capacity",
+            "integer number", "how many nonexistent paths will be remembered, default is 10000");
+    s_bos_args["bos.fs.meta.max_stale"] = BosfsConfItem("meta_max_stale",
+            "seconds", "for how many seconds an expired meta is still served while it is refreshed in background, default is 0 (disabled)");
+    s_bos_args["bos.fs.meta.dir_expires"] = BosfsConfItem("meta_dir_expires",
+            "seconds", "for how many seconds a directory listing will be served locally, default is 0 (disabled)");
     s_bos_args["bos.fs.storage_class"] = BosfsConfItem("storage_class",
             "standard or standard_ia; case ignored",
             "when specified this option, any upload action will use the storage class");
+    s_bos_args["bos.fs.meta.stat_from_listing"] = BosfsConfItem("stat_from_listing", "",
+            "readdir takes size and mtime from listings instead of heading every object; listings carry no uid/gid/mode or symlink type, so getattr (ls -l, stat) still heads each object once");
+    s_bos_args["bos.fs.meta.persist"] = BosfsConfItem("meta_persist", "",
+            "keep meta loaded from bos under cache directory, so it is reused after remount");
+    s_bos_args["bos.fs.meta.kernel_cache"] = BosfsConfItem("meta_kernel_cache", "",
+            "let kernel cache entries and attributes as long as meta expires, changes made through this mount are invalidated");
+    s_bos_args["bos.fs.meta.warmup_prefix"] = BosfsConfItem("meta_warmup_prefix",
+            "path relative to mountpoint, / for all",
+            "list this path recursively after mount and cache what is found, size and mtime come from listings like stat_from_listing");
+    s_bos_args["bos.fs.meta.warmup_parallel"] = BosfsConfItem("meta_warmup_parallel",
+            "integer number", "how many subdirectories of warmup_prefix are listed in parallel, default is 8");
+    s_bos_args["bos.fs.snapshot"] = BosfsConfItem("snapshot",
+            "file built with bos.fs.snapshot.build",
+            "mount read-only, stat and readdir are served from the snapshot and only file data is read from bos");
+    s_bos_args["bos.fs.snapshot.build"] = BosfsConfItem("snapshot_build", "file to write",
+            "list BUCKET once, write a snapshot of its namespace to the file and exit, MOUNTPOINT is not needed");
+    s_bos_args["bos.fs.invalidate_socket"] = BosfsConfItem("invalidate_socket",
+            "absolute path of a unix socket to create",
+            "receive invalidations as datagrams of lines \"path <path>\" or \"prefix <path>\", paths relative to mountpoint, so long meta_expires stays safe when objects are changed elsewhere");
     s_bos_args["bos.fs.createprefix"] = BosfsConfItem("createprefix", "",
             "create directory object if not exist when mounting");
     s_bos_args["bos.fs.tmpdir"] = BosfsConfItem("tmpdir", "an existing directory in absolute path",
@@ -190,6 +221,12 @@ static int parse_bos_args(BosfsOptions &bosfs_options, std::string &errmsg) {
     }
     if (s_bos_args["bos.fs.cache.base"].is_set) {
         bosfs_options.cache_dir = s_bos_args["bos.fs.cache.base"].value;
+    }
+    name = "bos.fs.cache.capacity";
+    if (s_bos_args[name].is_set) {
+        if (!StringUtil::byteunit2int(s_bos_args[name].value, &bosfs_options.cache_capacity)) {
+            return return_with_error_msg(errmsg, "%s: invalid number string:%s", name.c_str(), s_bos_args[name].value.c_str());
+        }
     }
 	if (s_bos_args["bos.fs.meta.expires"].is_set) {
 		int secs;
@@ -205,6 +242,60 @@ static int parse_bos_args(BosfsOptions &bosfs_options, std::string &errmsg) {
 		}
         bosfs_options.meta_capacity = num;
     }
+    name = "bos.fs.meta.memory_limit";
+    if (s_bos_args[name].is_set) {
+        if (!StringUtil::byteunit2int(s_bos_args[name].value, &bosfs_options.meta_memory_limit)) {
+            return return_with_error_msg(errmsg, "%s: invalid number string:%s", name.c_str(), s_bos_args[name].value.c_str());
+        }
+    }
+    name = "bos.fs.meta.negative_expires";
+    if (s_bos_args[name].is_set) {
+        if (!StringUtil::str2int(s_bos_args[name].value, &bosfs_options.meta_negative_expires_s)) {
+            return return_with_error_msg(errmsg, "%s: invalid number string:%s", name.c_str(), s_bos_args[name].value.c_str());
+        }
+    }
+    name = "bos.fs.meta.negative_capacity";
+    if (s_bos_args[name].is_set) {
+        if (!StringUtil::str2int(s_bos_args[name].value, &bosfs_options.meta_negative_capacity)) {
+            return return_with_error_msg(errmsg, "%s: invalid number string:%s", name.c_str(), s_bos_args[name].value.c_str());
+        }
+    }
+    name = "bos.fs.meta.max_stale";
+    if (s_bos_args[name].is_set) {
+        if (!StringUtil::str2int(s_bos_args[name].value, &bosfs_options.meta_max_stale_s)) {
+            return return_with_error_msg(errmsg, "%s: invalid number string:%s", name.c_str(), s_bos_args[name].value.c_str());
+        }
+    }
+    name = "bos.fs.meta.dir_expires";
+    if (s_bos_args[name].is_set) {
+        if (!StringUtil::str2int(s_bos_args[name].value, &bosfs_options.meta_dir_expires_s)) {
+            return return_with_error_msg(errmsg, "%s: invalid number string:%s", name.c_str(), s_bos_args[name].value.c_str());
+        }
+    }
+    if (s_bos_args["bos.fs.meta.stat_from_listing"].is_set) {
+        bosfs_options.stat_from_listing = true;
+    }
+    if (s_bos_args["bos.fs.meta.persist"].is_set) {
+        bosfs_options.meta_persist = true;
+    }
+    if (s_bos_args["bos.fs.meta.warmup_prefix"].is_set) {
+        bosfs_options.meta_warmup_prefix = s_bos_args["bos.fs.meta.warmup_prefix"].value;
+    }
+    name = "bos.fs.meta.warmup_parallel";
+    if (s_bos_args[name].is_set) {
+        if (!StringUtil::str2int(s_bos_args[name].value, &bosfs_options.meta_warmup_parallel)) {
+            return return_with_error_msg(errmsg, "%s: invalid number string:%s", name.c_str(), s_bos_args[name].value.c_str());
+        }
+    }
+    if (s_bos_args["bos.fs.snapshot"].is_set) {
+        bosfs_options.snapshot_path = s_bos_args["bos.fs.snapshot"].value;
+    }
+    if (s_bos_args["bos.fs.invalidate_socket"].is_set) {
+        bosfs_options.invalidate_socket = s_bos_args["bos.fs.invalidate_socket"].value;
+    }
+    if (s_bos_args["bos.fs.meta.kernel_cache"].is_set) {
+        bosfs_options.kernel_cache = true;
+    }
     if (s_bos_args["bos.fs.createprefix"].is_set) {
        bosfs_options.create_prefix = true;
     }
@@ -395,6 +486,15 @@ static int bosfs_main(int argc, char *argv[]) {
     struct fuse_operations bosfs_operation;
     std::string errmsg;
     Bosfs *bosfs = new Bosfs();
+    if (s_bos_args["bos.fs.snapshot.build"].is_set) {
+        int ret = bosfs_build_snapshot(s_bucket_path, bosfs, s_bosfs_options,
+                s_bos_args["bos.fs.snapshot.build"].value, errmsg);
+        if (ret != 0) {
+            die("build snapshot failed: %s", errmsg.c_str());
+        }
+        delete bosfs;
+        return 0;
+    }
     int ret = bosfs_prepare_fs_operations(s_bucket_path, s_mountpoint_path, bosfs, s_bosfs_options, bosfs_operation, errmsg);
     if (ret != 0) {
         die("preparation failed: %s", errmsg.c_str());
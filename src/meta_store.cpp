@@ -0,0 +1,558 @@
+/**
+ * bosfs - A fuse-based file system implemented on Baidu Object Storage(BOS)
+ *
+ * Copyright (c) 2016 Baidu.com, Inc. All rights reserved.
+ *
+ * @file    meta_store.cpp
+ * @brief   persistent file meta kept under cache directory across mounts
+ **/
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <map>
+#include <vector>
+
+#include "meta_store.h"
+#include "file_manager.h"
+#include "util.h"
+
+BEGIN_FS_NAMESPACE
+
+// payload layout, integers in host byte order since the log never leaves this host
+//   PUT:          name, load_time_s, flags, content_length, last_modified, etag,
+//                 content_type, user meta count, user meta key/value pairs
+//   DEL:          name
+//   DEL_SUBTREE:  name
+// strings are a 32 bit length followed by bytes
+enum { FLAG_DIR_OBJ = 1, FLAG_PREFIX = 2 };
+
+static void put_u32(std::string *buf, uint32_t v) {
+    buf->append((const char *) &v, sizeof(v));
+}
+
+static void put_u64(std::string *buf, uint64_t v) {
+    buf->append((const char *) &v, sizeof(v));
+}
+
+static void put_str(std::string *buf, const std::string &s) {
+    put_u32(buf, s.size());
+    buf->append(s);
+}
+
+class PayloadReader {
+public:
+    PayloadReader(const char *data, size_t size) : _p(data), _end(data + size) {}
+
+    bool get_u32(uint32_t *v) {
+        return get_raw(v, sizeof(*v));
+    }
+    bool get_u64(uint64_t *v) {
+        return get_raw(v, sizeof(*v));
+    }
+    bool get_str(std::string *s) {
+        uint32_t len = 0;
+        if (!get_u32(&len) || (size_t) (_end - _p) < len) {
+            return false;
+        }
+        s->assign(_p, len);
+        _p += len;
+        return true;
+    }
+
+private:
+    bool get_raw(void *v, size_t len) {
+        if ((size_t) (_end - _p) < len) {
+            return false;
+        }
+        memcpy(v, _p, len);
+        _p += len;
+        return true;
+    }
+
+    const char *_p;
+    const char *_end;
+};
+
+// FNV-1a, only meant to find torn writes at the tail of the log
+static uint32_t checksum(const char *data, size_t size) {
+    uint32_t h = 2166136261u;
+    for (size_t i = 0; i < size; ++i) {
+        h ^= (unsigned char) data[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+static int write_all(int fd, const std::string &data) {
+    size_t done = 0;
+    while (done < data.size()) {
+        ssize_t n = write(fd, data.data() + done, data.size() - done);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -errno;
+        }
+        done += n;
+    }
+    return 0;
+}
+
+MetaStore::MetaStore()
+    : _fd(-1), _expire_s(-1), _map(NULL), _map_size(0), _file_size(0), _live_bytes(0) {
+    pthread_mutex_init(&_mutex, NULL);
+}
+
+MetaStore::~MetaStore() {
+    close();
+    pthread_mutex_destroy(&_mutex);
+}
+
+int MetaStore::open(const std::string &path, int expire_s) {
+    MutexGuard lock(&_mutex);
+    if (_fd >= 0) {
+        return 0;
+    }
+    int fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_APPEND, 0600);
+    if (fd < 0) {
+        int err = errno;
+        BOSFS_ERR("could not open meta store %s, errno(%d)", path.c_str(), err);
+        return -err;
+    }
+    // two mounts appending to one log would corrupt it
+    if (flock(fd, LOCK_EX | LOCK_NB) != 0) {
+        int err = errno;
+        BOSFS_ERR("meta store %s is used by another process, errno(%d)", path.c_str(), err);
+        ::close(fd);
+        return -EBUSY;
+    }
+    _fd = fd;
+    _path = path;
+    _expire_s = expire_s;
+    int ret = map_log();
+    if (ret == 0) {
+        ret = scan();
+    }
+    if (ret != 0) {
+        unmap_log();
+        ::close(_fd);
+        _fd = -1;
+        _index.clear();
+        return ret;
+    }
+    if (need_compact()) {
+        rewrite();
+    }
+    BOSFS_INFO("meta store %s opened with %zu records", path.c_str(), _index.size());
+    return 0;
+}
+
+void MetaStore::close() {
+    flush();
+    MutexGuard lock(&_mutex);
+    if (_fd < 0) {
+        return;
+    }
+    unmap_log();
+    ::close(_fd);
+    _fd = -1;
+    _index.clear();
+    _file_size = 0;
+    _live_bytes = 0;
+}
+
+bool MetaStore::load(File *file) {
+    std::string payload;
+    {
+        MutexGuard lock(&_mutex);
+        if (_fd < 0) {
+            return false;
+        }
+        std::unordered_map<std::string, std::string>::iterator pending =
+            _pending.find(file->name());
+        if (pending != _pending.end()) {
+            payload = pending->second;
+        } else {
+            Index::iterator it = _index.find(file->name());
+            if (it == _index.end() || !read_payload(it->second, &payload)) {
+                return false;
+            }
+        }
+    }
+    PayloadReader reader(payload.data(), payload.size());
+    std::string name;
+    uint64_t load_time_s = 0;
+    uint32_t flags = 0;
+    uint64_t content_length = 0;
+    uint64_t last_modified = 0;
+    std::string etag;
+    std::string content_type;
+    uint32_t count = 0;
+    if (!reader.get_str(&name) || !reader.get_u64(&load_time_s) || !reader.get_u32(&flags)
+            || !reader.get_u64(&content_length) || !reader.get_u64(&last_modified)
+            || !reader.get_str(&etag) || !reader.get_str(&content_type)
+            || !reader.get_u32(&count)) {
+        return false;
+    }
+    if (_expire_s >= 0 && (int64_t) load_time_s + _expire_s < get_system_time_s()) {
+        return false;
+    }
+    std::map<std::string, std::string> user_meta;
+    for (uint32_t i = 0; i < count; ++i) {
+        std::string key;
+        if (!reader.get_str(&key) || !reader.get_str(&user_meta[key])) {
+            return false;
+        }
+    }
+    // file is not shared with anyone yet
+    bcesdk_ns::ObjectMetaData meta;
+    meta.set_content_length(content_length);
+    meta.set_last_modified(last_modified);
+    meta.set_etag(etag);
+    meta.set_content_type(content_type);
+    meta.mutable_user_meta()->swap(user_meta);
+    // user meta is all there, so stat is as good as from a HEAD until the record
+    // expires, only system headers other than these are not kept
+    file->set_meta(meta, true);
+    file->set_is_dir_obj(flags & FLAG_DIR_OBJ);
+    file->set_is_prefix(flags & FLAG_PREFIX);
+    file->set_load_time_s(load_time_s);
+    return true;
+}
+
+void MetaStore::put(File &file) {
+    const bcesdk_ns::ObjectMetaData &meta = file.snapshot()->meta();
+    std::string payload;
+    put_str(&payload, file.name());
+    put_u64(&payload, file.load_time_s());
+    put_u32(&payload, (file.is_dir_obj() ? FLAG_DIR_OBJ : 0)
+            | (file.is_prefix() ? FLAG_PREFIX : 0));
+    put_u64(&payload, meta.content_length());
+    put_u64(&payload, meta.last_modified());
+    put_str(&payload, meta.etag());
+    put_str(&payload, meta.content_type());
+    const std::map<std::string, std::string> &user_meta = meta.user_meta();
+    put_u32(&payload, user_meta.size());
+    for (std::map<std::string, std::string>::const_iterator it = user_meta.begin();
+            it != user_meta.end(); ++it) {
+        put_str(&payload, it->first);
+        put_str(&payload, it->second);
+    }
+    MutexGuard lock(&_mutex);
+    if (_fd < 0) {
+        return;
+    }
+    std::unordered_map<std::string, std::string>::iterator it = _pending.find(file.name());
+    if (it != _pending.end()) {
+        it->second.swap(payload);
+    } else if (_pending.size() < MAX_PENDING) {
+        _pending[file.name()].swap(payload);
+    }
+}
+
+void MetaStore::flush() {
+    MutexGuard lock(&_mutex);
+    if (_fd < 0 || _pending.empty()) {
+        return;
+    }
+    std::vector<std::pair<const std::string *, Location> > locs;
+    locs.reserve(_pending.size());
+    std::string records;
+    for (std::unordered_map<std::string, std::string>::iterator it = _pending.begin();
+            it != _pending.end(); ++it) {
+        Location loc = {_file_size + records.size(), (uint32_t) it->second.size()};
+        locs.push_back(std::make_pair(&it->first, loc));
+        records.append(make_record(RECORD_PUT, it->second));
+    }
+    int ret = write_all(_fd, records);
+    if (ret != 0) {
+        BOSFS_WARN("append to meta store %s failed, errno(%d)", _path.c_str(), -ret);
+        // never leave half a record in front of the next one
+        if (ftruncate(_fd, _file_size) != 0) {
+            BOSFS_ERR("could not truncate meta store %s, errno(%d)", _path.c_str(), errno);
+        }
+        _pending.clear();
+        return;
+    }
+    _file_size += records.size();
+    for (size_t i = 0; i < locs.size(); ++i) {
+        const Location &loc = locs[i].second;
+        std::pair<Index::iterator, bool> ret = _index.insert(
+                Index::value_type(*locs[i].first, loc));
+        if (!ret.second) {
+            _live_bytes -= sizeof(RecordHeader) + ret.first->second.size;
+            ret.first->second = loc;
+        }
+        _live_bytes += sizeof(RecordHeader) + loc.size;
+    }
+    _pending.clear();
+}
+
+void MetaStore::erase(const std::string &name) {
+    MutexGuard lock(&_mutex);
+    if (_fd < 0) {
+        return;
+    }
+    _pending.erase(name);
+    Index::iterator it = _index.find(name);
+    if (it == _index.end()) {
+        return;
+    }
+    _live_bytes -= sizeof(RecordHeader) + it->second.size;
+    _index.erase(it);
+    std::string payload;
+    put_str(&payload, name);
+    Location loc;
+    append(RECORD_DEL, payload, &loc);
+}
+
+void MetaStore::erase_subtree(const std::string &name) {
+    MutexGuard lock(&_mutex);
+    if (_fd < 0) {
+        return;
+    }
+    erase_pending_subtree(name);
+    if (erase_subtree_from_index(name) == 0) {
+        return;
+    }
+    std::string payload;
+    put_str(&payload, name);
+    Location loc;
+    append(RECORD_DEL_SUBTREE, payload, &loc);
+}
+
+void MetaStore::compact() {
+    MutexGuard lock(&_mutex);
+    if (_fd < 0 || !need_compact()) {
+        return;
+    }
+    rewrite();
+}
+
+int MetaStore::scan() {
+    int64_t now = get_system_time_s();
+    uint64_t offset = 0;
+    _index.clear();
+    _live_bytes = 0;
+    while (offset + sizeof(RecordHeader) <= _map_size) {
+        RecordHeader header;
+        memcpy(&header, _map + offset, sizeof(header));
+        const char *data = _map + offset + sizeof(header);
+        if (header.magic != RECORD_MAGIC
+                || header.size > _map_size - offset - sizeof(header)
+                || header.checksum != checksum(data, header.size)) {
+            break;
+        }
+        PayloadReader reader(data, header.size);
+        std::string name;
+        uint64_t load_time_s = 0;
+        if (!reader.get_str(&name)) {
+            break;
+        }
+        if (header.type == RECORD_PUT) {
+            if (!reader.get_u64(&load_time_s)) {
+                break;
+            }
+            Index::iterator it = _index.find(name);
+            if (it != _index.end()) {
+                _live_bytes -= sizeof(RecordHeader) + it->second.size;
+                _index.erase(it);
+            }
+            if (_expire_s < 0 || (int64_t) load_time_s + _expire_s >= now) {
+                Location loc = {offset, header.size};
+                _index[name] = loc;
+                _live_bytes += sizeof(RecordHeader) + header.size;
+            }
+        } else if (header.type == RECORD_DEL) {
+            Index::iterator it = _index.find(name);
+            if (it != _index.end()) {
+                _live_bytes -= sizeof(RecordHeader) + it->second.size;
+                _index.erase(it);
+            }
+        } else if (header.type == RECORD_DEL_SUBTREE) {
+            erase_subtree_from_index(name);
+        } else {
+            break;
+        }
+        offset += sizeof(RecordHeader) + header.size;
+    }
+    _file_size = offset;
+    if (offset == _map_size) {
+        return 0;
+    }
+    // a torn write from a crash, drop it so appends start from a record boundary
+    BOSFS_WARN("meta store %s is broken at offset %llu, truncated", _path.c_str(),
+            (unsigned long long) offset);
+    if (ftruncate(_fd, offset) != 0) {
+        int err = errno;
+        BOSFS_ERR("could not truncate meta store %s, errno(%d)", _path.c_str(), err);
+        return -err;
+    }
+    unmap_log();
+    return map_log();
+}
+
+int MetaStore::map_log() {
+    struct stat st;
+    if (fstat(_fd, &st) != 0) {
+        return -errno;
+    }
+    if (st.st_size == 0) {
+        return 0;
+    }
+    void *p = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, _fd, 0);
+    if (p == MAP_FAILED) {
+        int err = errno;
+        BOSFS_ERR("could not map meta store %s, errno(%d)", _path.c_str(), err);
+        return -err;
+    }
+    _map = (char *) p;
+    _map_size = st.st_size;
+    return 0;
+}
+
+void MetaStore::unmap_log() {
+    if (_map != NULL) {
+        munmap(_map, _map_size);
+        _map = NULL;
+        _map_size = 0;
+    }
+}
+
+bool MetaStore::read_payload(const Location &loc, std::string *payload) {
+    uint64_t offset = loc.offset + sizeof(RecordHeader);
+    if (offset + loc.size <= _map_size) {
+        payload->assign(_map + offset, loc.size);
+        return true;
+    }
+    // appended after the log was mapped
+    payload->resize(loc.size);
+    size_t done = 0;
+    while (done < loc.size) {
+        ssize_t n = pread(_fd, &(*payload)[done], loc.size - done, offset + done);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return false;
+        }
+        done += n;
+    }
+    return true;
+}
+
+std::string MetaStore::make_record(uint32_t type, const std::string &payload) {
+    RecordHeader header;
+    header.magic = RECORD_MAGIC;
+    header.type = type;
+    header.size = payload.size();
+    header.checksum = checksum(payload.data(), payload.size());
+    std::string record((const char *) &header, sizeof(header));
+    record.append(payload);
+    return record;
+}
+
+int MetaStore::append(uint32_t type, const std::string &payload, Location *loc) {
+    std::string record = make_record(type, payload);
+    int ret = write_all(_fd, record);
+    if (ret != 0) {
+        BOSFS_WARN("append to meta store %s failed, errno(%d)", _path.c_str(), -ret);
+        // never leave half a record in front of the next one
+        if (ftruncate(_fd, _file_size) != 0) {
+            BOSFS_ERR("could not truncate meta store %s, errno(%d)", _path.c_str(), errno);
+        }
+        return ret;
+    }
+    loc->offset = _file_size;
+    loc->size = payload.size();
+    _file_size += record.size();
+    return 0;
+}
+
+size_t MetaStore::erase_subtree_from_index(const std::string &name) {
+    std::string prefix = name == "/" ? name : name + "/";
+    size_t erased = 0;
+    for (Index::iterator it = _index.begin(); it != _index.end();) {
+        if (it->first == name || it->first.compare(0, prefix.size(), prefix) == 0) {
+            _live_bytes -= sizeof(RecordHeader) + it->second.size;
+            it = _index.erase(it);
+            ++erased;
+        } else {
+            ++it;
+        }
+    }
+    return erased;
+}
+
+void MetaStore::erase_pending_subtree(const std::string &name) {
+    std::string prefix = name == "/" ? name : name + "/";
+    for (std::unordered_map<std::string, std::string>::iterator it = _pending.begin();
+            it != _pending.end();) {
+        if (it->first == name || it->first.compare(0, prefix.size(), prefix) == 0) {
+            it = _pending.erase(it);
+        } else {
+            ++it;
+        }
+    }
+}
+
+int MetaStore::rewrite() {
+    std::string tmp_path = _path + ".tmp";
+    int fd = ::open(tmp_path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_APPEND, 0600);
+    if (fd < 0) {
+        int err = errno;
+        BOSFS_ERR("could not create %s, errno(%d)", tmp_path.c_str(), err);
+        return -err;
+    }
+    flock(fd, LOCK_EX | LOCK_NB);
+    int64_t now = get_system_time_s();
+    Index index;
+    uint64_t size = 0;
+    int ret = 0;
+    for (Index::iterator it = _index.begin(); it != _index.end(); ++it) {
+        std::string payload;
+        if (!read_payload(it->second, &payload)) {
+            continue;
+        }
+        PayloadReader reader(payload.data(), payload.size());
+        std::string name;
+        uint64_t load_time_s = 0;
+        if (!reader.get_str(&name) || !reader.get_u64(&load_time_s)
+                || (_expire_s >= 0 && (int64_t) load_time_s + _expire_s < now)) {
+            continue;
+        }
+        std::string record = make_record(RECORD_PUT, payload);
+        ret = write_all(fd, record);
+        if (ret != 0) {
+            break;
+        }
+        Location loc = {size, (uint32_t) payload.size()};
+        index[it->first] = loc;
+        size += record.size();
+    }
+    if (ret == 0 && rename(tmp_path.c_str(), _path.c_str()) != 0) {
+        ret = -errno;
+    }
+    if (ret != 0) {
+        BOSFS_ERR("could not compact meta store %s, errno(%d)", _path.c_str(), -ret);
+        ::close(fd);
+        unlink(tmp_path.c_str());
+        return ret;
+    }
+    BOSFS_INFO("meta store %s compacted from %llu to %llu bytes", _path.c_str(),
+            (unsigned long long) _file_size, (unsigned long long) size);
+    unmap_log();
+    ::close(_fd);
+    _fd = fd;
+    _index.swap(index);
+    _file_size = size;
+    _live_bytes = size;
+    return map_log();
+}
+
+END_FS_NAMESPACE
@@ -0,0 +1,104 @@
+/**
+ * bosfs - A fuse-based file system implemented on Baidu Object Storage(BOS)
+ *
+ * Copyright (c) 2016 Baidu.com, Inc. All rights reserved.
+ *
+ * @file    meta_store.h
+ * @brief   persistent file meta kept under cache directory across mounts
+ **/
+#ifndef BAIDU_BOS_BOSFS_META_STORE_H
+#define BAIDU_BOS_BOSFS_META_STORE_H
+
+#include <stdint.h>
+#include <pthread.h>
+
+#include <string>
+#include <unordered_map>
+
+#include "common.h"
+
+BEGIN_FS_NAMESPACE
+
+class File;
+
+// append-only log of file meta. the latest record of a name wins and a deletion record
+// hides older ones. the log is mapped at open so a restarted mount answers from it at
+// close to memory speed, records appended later are read with pread. the whole log is
+// rewritten with live records only once garbage outgrows them. puts are queued and
+// appended in batches by flush(), so a miss never waits for the disk
+class MetaStore {
+public:
+    MetaStore();
+    ~MetaStore();
+
+    // records older than expire_s are ignored, never expire if expire_s < 0
+    int open(const std::string &path, int expire_s);
+    void close();
+    bool is_open() const { return _fd >= 0; }
+
+    // fill file from the latest fresh record of its name, return false if there is none
+    bool load(File *file);
+    // queue a record of file, dropped if too many are queued already
+    void put(File &file);
+    // append queued records in one write
+    void flush();
+    void erase(const std::string &name);
+    // erase name and every name below it
+    void erase_subtree(const std::string &name);
+    // rewrite the log if most of it is garbage
+    void compact();
+
+private:
+    enum {
+        RECORD_MAGIC = 0x31544d42,  // "BMT1"
+        RECORD_PUT = 1,
+        RECORD_DEL = 2,
+        RECORD_DEL_SUBTREE = 3
+    };
+    enum { MIN_COMPACT_SIZE = 16 * 1024 * 1024 };
+    enum { MAX_PENDING = 16384 };
+    struct RecordHeader {
+        uint32_t magic;
+        uint32_t type;
+        uint32_t size;      // bytes of payload following the header
+        uint32_t checksum;  // of payload
+    };
+    struct Location {
+        uint64_t offset;    // of record header
+        uint32_t size;      // of payload
+    };
+    typedef std::unordered_map<std::string, Location> Index;
+
+    static std::string make_record(uint32_t type, const std::string &payload);
+
+    // following functions must be called with _mutex held
+    int scan();
+    int map_log();
+    void unmap_log();
+    bool read_payload(const Location &loc, std::string *payload);
+    int append(uint32_t type, const std::string &payload, Location *loc);
+    // drop queued records of name and every name below it
+    void erase_pending_subtree(const std::string &name);
+    // return number of records erased
+    size_t erase_subtree_from_index(const std::string &name);
+    bool need_compact() const {
+        return _file_size > MIN_COMPACT_SIZE && _file_size - _live_bytes > _live_bytes;
+    }
+    int rewrite();
+
+    std::string _path;
+    int _fd;
+    int _expire_s;
+    char *_map;
+    size_t _map_size;
+    uint64_t _file_size;
+    uint64_t _live_bytes;
+    Index _index;
+    // payloads of puts not appended yet, by name
+    std::unordered_map<std::string, std::string> _pending;
+    pthread_mutex_t _mutex;
+};
+
+END_FS_NAMESPACE
+
+#endif
@@ -0,0 +1,251 @@
+/**
+ * bosfs - A fuse-based file system implemented on Baidu Object Storage(BOS)
+ *
+ * Copyright (c) 2016 Baidu.com, Inc. All rights reserved.
+ *
+ * @file    meta_warmer.cpp
+ * @brief   loads meta of a known prefix into file manager right after mount
+ **/
+#include "bosfs_lib/bosfs_lib.h"
+#include "meta_warmer.h"
+#include "bosfs_util.h"
+#include "util.h"
+
+BEGIN_FS_NAMESPACE
+
+MetaWarmer::MetaWarmer(BosfsUtil *bosfs_util, FileManager *file_manager)
+    : _bosfs_util(bosfs_util), _file_manager(file_manager), _record_listing(false),
+      _start_time_s(0), _running(false), _loaded(0), _busy(0) {
+    pthread_mutex_init(&_mutex, NULL);
+    pthread_cond_init(&_cond, NULL);
+}
+
+MetaWarmer::~MetaWarmer() {
+    stop();
+    pthread_cond_destroy(&_cond);
+    pthread_mutex_destroy(&_mutex);
+}
+
+int MetaWarmer::start(const std::string &prefix, int parallel) {
+    MutexGuard lock(&_mutex);
+    if (!_threads.empty()) {
+        return 0;
+    }
+    std::string relative(prefix);
+    while (!relative.empty() && relative[0] == '/') {
+        relative.erase(0, 1);
+    }
+    if (!relative.empty() && *relative.rbegin() != '/') {
+        relative.push_back('/');
+    }
+    _root = _bosfs_util->options().bucket_prefix + relative;
+    // listings are of no use if they are never served
+    _record_listing = _file_manager->dir_expire_s() > 0;
+    _start_time_s = get_system_time_s();
+    _running = true;
+    _loaded = 0;
+    _busy = 0;
+    _tasks.clear();
+    Task task = {_root, false};
+    _tasks.push_back(task);
+    for (int i = 0; i < std::max(parallel, 1); ++i) {
+        pthread_t thread;
+        int ret = pthread_create(&thread, NULL, worker_thread, this);
+        if (ret != 0) {
+            BOSFS_ERR("failed to start meta warm up thread, errno: %d", ret);
+            if (_threads.empty()) {
+                _running = false;
+                return -ret;
+            }
+            break;
+        }
+        _threads.push_back(thread);
+    }
+    BOSFS_INFO("warming up meta of %s with %zu workers", _root.c_str(), _threads.size());
+    return 0;
+}
+
+void MetaWarmer::stop() {
+    std::vector<pthread_t> threads;
+    {
+        MutexGuard lock(&_mutex);
+        _running = false;
+        pthread_cond_broadcast(&_cond);
+        threads.swap(_threads);
+    }
+    for (size_t i = 0; i < threads.size(); ++i) {
+        pthread_join(threads[i], NULL);
+    }
+}
+
+void *MetaWarmer::worker_thread(void *arg) {
+    reinterpret_cast<MetaWarmer *>(arg)->worker_loop();
+    return NULL;
+}
+
+void MetaWarmer::worker_loop() {
+    pthread_mutex_lock(&_mutex);
+    while (_running) {
+        if (_tasks.empty()) {
+            // a busy worker may still queue subdirectories
+            if (_busy == 0) {
+                break;
+            }
+            pthread_cond_wait(&_cond, &_mutex);
+            continue;
+        }
+        Task task = _tasks.back();
+        _tasks.pop_back();
+        ++_busy;
+        pthread_mutex_unlock(&_mutex);
+        bool ok = task.recursive ? warm_subtree(task.prefix) : warm_dir(task.prefix);
+        pthread_mutex_lock(&_mutex);
+        --_busy;
+        if (!ok && _running) {
+            BOSFS_INFO("meta cache is full, warm up of %s stopped after %zu entries",
+                    _root.c_str(), (size_t) _loaded);
+            _running = false;
+        } else if (_running && _busy == 0 && _tasks.empty()) {
+            BOSFS_INFO("warm up of %s finished with %zu entries in %lld seconds",
+                    _root.c_str(), (size_t) _loaded,
+                    (long long) (get_system_time_s() - _start_time_s));
+        }
+        pthread_cond_broadcast(&_cond);
+    }
+    pthread_mutex_unlock(&_mutex);
+}
+
+bool MetaWarmer::warm_dir(const std::string &prefix) {
+    uint64_t generation = _file_manager->dir_generation(dir_path(prefix));
+    DirEntryList children;
+    std::string marker;
+    do {
+        std::vector<ObjectSummary> objects;
+        std::vector<std::string> prefixes;
+        if (_bosfs_util->list_objects(prefix, 1000, marker, "/", &objects, &prefixes) != 0) {
+            BOSFS_WARN("warm up listing of %s failed", prefix.c_str());
+            return true;
+        }
+        std::vector<Task> tasks;
+        for (size_t i = 0; i < prefixes.size(); ++i) {
+            FilePtr file = make_ref<File>(_bosfs_util, dir_path(prefixes[i]));
+            file->set_is_prefix(true);
+            if (!add(file->name(), file)) {
+                return false;
+            }
+            children.push_back(DirEntry(
+                        _bosfs_util->object_to_basename(prefixes[i], prefix), true));
+            Task task = {prefixes[i], true};
+            tasks.push_back(task);
+        }
+        for (size_t i = 0; i < objects.size(); ++i) {
+            bool is_dir = *objects[i].key.rbegin() == '/';
+            FilePtr file = make_ref<File>(_bosfs_util, dir_path(objects[i].key));
+            file->set_from_summary(objects[i]);
+            file->set_is_dir_obj(is_dir);
+            if (!add(file->name(), file)) {
+                return false;
+            }
+            children.push_back(DirEntry(
+                        _bosfs_util->object_to_basename(objects[i].key, prefix), is_dir));
+        }
+        if (!tasks.empty()) {
+            MutexGuard lock(&_mutex);
+            _tasks.insert(_tasks.end(), tasks.begin(), tasks.end());
+            pthread_cond_broadcast(&_cond);
+        }
+        if (!_running) {
+            return true;
+        }
+    } while (!marker.empty());
+    if (_record_listing) {
+        _file_manager->set_dir_children(dir_path(prefix), children, generation);
+    }
+    return true;
+}
+
+bool MetaWarmer::warm_subtree(const std::string &prefix) {
+    std::vector<OpenDir> dirs;
+    open_dir(&dirs, prefix);
+    std::string marker;
+    do {
+        std::vector<ObjectSummary> objects;
+        std::vector<std::string> unused;
+        if (_bosfs_util->list_objects(prefix, 1000, marker, NULL, &objects, &unused) != 0) {
+            // directories still open are incomplete and never recorded
+            BOSFS_WARN("warm up listing of %s failed", prefix.c_str());
+            return true;
+        }
+        for (size_t i = 0; i < objects.size(); ++i) {
+            const std::string &key = objects[i].key;
+            while (key.compare(0, dirs.back().prefix.size(), dirs.back().prefix) != 0) {
+                close_dir(&dirs);
+            }
+            // directories between the innermost open one and key, the last one is key
+            // itself if it is a directory object
+            size_t slash = 0;
+            while ((slash = key.find('/', dirs.back().prefix.size())) != std::string::npos) {
+                std::string sub = key.substr(0, slash + 1);
+                FilePtr file = make_ref<File>(_bosfs_util, dir_path(sub));
+                if (slash + 1 < key.size()) {
+                    file->set_is_prefix(true);
+                } else {
+                    file->set_from_summary(objects[i]);
+                    file->set_is_dir_obj(true);
+                }
+                if (!add(file->name(), file)) {
+                    return false;
+                }
+                dirs.back().children.push_back(DirEntry(
+                            _bosfs_util->object_to_basename(sub, dirs.back().prefix), true));
+                open_dir(&dirs, sub);
+            }
+            if (*key.rbegin() == '/') {
+                continue;
+            }
+            FilePtr file = make_ref<File>(_bosfs_util, dir_path(key));
+            file->set_from_summary(objects[i]);
+            if (!add(file->name(), file)) {
+                return false;
+            }
+            dirs.back().children.push_back(DirEntry(
+                        _bosfs_util->object_to_basename(key, dirs.back().prefix), false));
+        }
+        if (!_running) {
+            return true;
+        }
+    } while (!marker.empty());
+    while (!dirs.empty()) {
+        close_dir(&dirs);
+    }
+    return true;
+}
+
+void MetaWarmer::open_dir(std::vector<OpenDir> *dirs, const std::string &prefix) {
+    dirs->push_back(OpenDir());
+    dirs->back().prefix = prefix;
+    dirs->back().generation = _file_manager->dir_generation(dir_path(prefix));
+}
+
+void MetaWarmer::close_dir(std::vector<OpenDir> *dirs) {
+    OpenDir &dir = dirs->back();
+    if (_record_listing) {
+        _file_manager->set_dir_children(dir_path(dir.prefix), dir.children, dir.generation);
+    }
+    dirs->pop_back();
+}
+
+std::string MetaWarmer::dir_path(const std::string &prefix) {
+    return prefix.empty() ? "/" : _bosfs_util->object_to_path(prefix);
+}
+
+bool MetaWarmer::add(const std::string &path, FilePtr &file) {
+    if (_file_manager->is_full()) {
+        return false;
+    }
+    _file_manager->add(path, file);
+    ++_loaded;
+    return true;
+}
+
+END_FS_NAMESPACE
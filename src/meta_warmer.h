@@ -0,0 +1,82 @@
+/**
+ * bosfs - A fuse-based file system implemented on Baidu Object Storage(BOS)
+ *
+ * Copyright (c) 2016 Baidu.com, Inc. All rights reserved.
+ *
+ * @file    meta_warmer.h
+ * @brief   loads meta of a known prefix into file manager right after mount
+ **/
+#ifndef BAIDU_BOS_BOSFS_META_WARMER_H
+#define BAIDU_BOS_BOSFS_META_WARMER_H
+
+#include <stdint.h>
+#include <pthread.h>
+
+#include <atomic>
+#include <string>
+#include <vector>
+
+#include "common.h"
+#include "file_manager.h"
+
+BEGIN_FS_NAMESPACE
+
+class BosfsUtil;
+
+// the prefix is listed once with delimiter, every first level subdirectory found is
+// then listed recursively without delimiter by one of the workers. objects come in key
+// order, so a directory is complete as soon as a key outside of it shows up, and its
+// listing is recorded right away. mount serves requests meanwhile
+class MetaWarmer {
+public:
+    MetaWarmer(BosfsUtil *bosfs_util, FileManager *file_manager);
+    ~MetaWarmer();
+
+    // prefix is relative to mount point, "/" for the whole mount. must be called after
+    // fuse daemonized, threads do not survive fork()
+    int start(const std::string &prefix, int parallel);
+    // abandon warming up and wait for workers
+    void stop();
+
+private:
+    struct Task {
+        std::string prefix;     // object prefix ending with '/', empty for bucket root
+        bool recursive;
+    };
+    // directory whose listing is being collected
+    struct OpenDir {
+        std::string prefix;
+        DirEntryList children;
+        uint64_t generation;
+    };
+
+    static void *worker_thread(void *arg);
+    void worker_loop();
+    // list prefix with delimiter, queue its subdirectories, return false on failure
+    bool warm_dir(const std::string &prefix);
+    bool warm_subtree(const std::string &prefix);
+    void open_dir(std::vector<OpenDir> *dirs, const std::string &prefix);
+    void close_dir(std::vector<OpenDir> *dirs);
+    std::string dir_path(const std::string &prefix);
+    // cache file unless file manager is full, return false once it is
+    bool add(const std::string &path, FilePtr &file);
+
+    BosfsUtil *_bosfs_util;
+    FileManager *_file_manager;
+    std::string _root;
+    bool _record_listing;
+    int64_t _start_time_s;
+    std::atomic<bool> _running;
+    std::atomic<size_t> _loaded;
+
+    // following are protected by _mutex
+    std::vector<Task> _tasks;
+    int _busy;
+    std::vector<pthread_t> _threads;
+    pthread_mutex_t _mutex;
+    pthread_cond_t _cond;
+};
+
+END_FS_NAMESPACE
+
+#endif
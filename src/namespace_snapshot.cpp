@@ -0,0 +1,411 @@
+/**
+ * bosfs - A fuse-based file system implemented on Baidu Object Storage(BOS)
+ *
+ * Copyright (c) 2016 Baidu.com, Inc. All rights reserved.
+ *
+ * @file    namespace_snapshot.cpp
+ * @brief   read-only namespace of an immutable prefix, built offline and mapped at mount
+ **/
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <algorithm>
+#include <map>
+
+#include "bosfs_lib/bosfs_lib.h"
+#include "namespace_snapshot.h"
+#include "bosfs_util.h"
+#include "file_manager.h"
+#include "util.h"
+
+BEGIN_FS_NAMESPACE
+
+static int compare_bytes(const char *a, size_t a_size, const char *b, size_t b_size) {
+    int c = memcmp(a, b, std::min(a_size, b_size));
+    if (c != 0) {
+        return c;
+    }
+    return a_size < b_size ? -1 : (a_size > b_size ? 1 : 0);
+}
+
+// "/a/b" is "b" in "/a", "/a" is "a" in "/"
+static size_t parent_size_of(const std::string &name) {
+    size_t pos = name.rfind('/');
+    return pos == 0 ? 1 : pos;
+}
+
+static size_t base_offset_of(size_t parent_size) {
+    return parent_size == 1 ? 1 : parent_size + 1;
+}
+
+static int write_all(int fd, const std::string &data) {
+    size_t done = 0;
+    while (done < data.size()) {
+        ssize_t n = write(fd, data.data() + done, data.size() - done);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -errno;
+        }
+        done += n;
+    }
+    return 0;
+}
+
+NamespaceSnapshot::NamespaceSnapshot()
+    : _map(NULL), _map_size(0), _records(NULL), _count(0), _strings(NULL),
+      _strings_size(0) {
+}
+
+NamespaceSnapshot::~NamespaceSnapshot() {
+    close();
+}
+
+namespace {
+
+struct BuildEntry {
+    BuildEntry() : size(0), mtime(0), mode(0), uid(0), gid(0), is_prefix(false) {}
+    int64_t size;
+    int64_t mtime;
+    uint32_t mode;
+    uint32_t uid;
+    uint32_t gid;
+    bool is_prefix;
+    std::string etag;
+};
+
+struct SortItem {
+    const std::string *name;
+    size_t parent_size;
+    const BuildEntry *entry;
+
+    bool operator<(const SortItem &other) const {
+        int c = compare_bytes(name->data(), parent_size,
+                other.name->data(), other.parent_size);
+        if (c != 0) {
+            return c < 0;
+        }
+        size_t base = base_offset_of(parent_size);
+        size_t other_base = base_offset_of(other.parent_size);
+        return compare_bytes(name->data() + base, name->size() - base,
+                other.name->data() + other_base, other.name->size() - other_base) < 0;
+    }
+};
+
+}
+
+int NamespaceSnapshot::build(BosfsUtil *bosfs_util, const std::string &path,
+        std::string &errmsg) {
+    const std::string &prefix = bosfs_util->options().bucket_prefix;
+    std::string root = prefix.empty() ? "/" : bosfs_util->object_to_path(prefix);
+    // a directory found as an object replaces the one implied by its children
+    std::map<std::string, BuildEntry> entries;
+    if (root != "/") {
+        entries[root].is_prefix = true;
+    }
+    std::string marker;
+    do {
+        std::vector<ObjectSummary> objects;
+        std::vector<std::string> unused;
+        if (bosfs_util->list_objects(prefix, 1000, marker, NULL, &objects, &unused) != 0) {
+            return return_with_error_msg(errmsg, "list %s failed", prefix.c_str());
+        }
+        // listings carry no mode or owner, which only come with a HEAD of each object.
+        // a snapshot is kept for long, so one failed HEAD fails the build instead of
+        // writing a default stat into it
+        std::vector<std::string> keys;
+        std::vector<struct stat> stats;
+        std::vector<bool> exists;
+        for (size_t i = 0; i < objects.size(); ++i) {
+            keys.push_back(objects[i].key);
+        }
+        if (bosfs_util->multiple_head_stat(keys, &stats, &exists) != 0) {
+            return return_with_error_msg(errmsg, "head objects under %s failed",
+                    prefix.c_str());
+        }
+        for (size_t i = 0; i < objects.size(); ++i) {
+            std::string name = bosfs_util->object_to_path(objects[i].key);
+            // deleted between listing and HEAD
+            if (name == root || !exists[i]) {
+                continue;
+            }
+            BuildEntry &entry = entries[name];
+            entry.is_prefix = false;
+            entry.size = stats[i].st_size;
+            entry.mtime = stats[i].st_mtime;
+            entry.mode = stats[i].st_mode;
+            entry.uid = stats[i].st_uid;
+            entry.gid = stats[i].st_gid;
+            entry.etag = objects[i].etag;
+            // once a parent is there, so are all its ancestors
+            size_t pos = name.rfind('/');
+            while (pos != std::string::npos && pos > 0 && (root == "/" || pos > root.size())) {
+                std::string parent = name.substr(0, pos);
+                if (entries.find(parent) != entries.end()) {
+                    break;
+                }
+                entries[parent].is_prefix = true;
+                pos = parent.rfind('/');
+            }
+        }
+    } while (!marker.empty());
+
+    std::vector<SortItem> items;
+    items.reserve(entries.size());
+    for (std::map<std::string, BuildEntry>::const_iterator it = entries.begin();
+            it != entries.end(); ++it) {
+        SortItem item = {&it->first, parent_size_of(it->first), &it->second};
+        items.push_back(item);
+    }
+    std::sort(items.begin(), items.end());
+
+    std::string strings(root);
+    std::string records;
+    records.reserve(items.size() * sizeof(Record));
+    for (size_t i = 0; i < items.size(); ++i) {
+        const BuildEntry &entry = *items[i].entry;
+        Record record;
+        memset(&record, 0, sizeof(record));
+        record.name_offset = strings.size();
+        record.name_size = items[i].name->size();
+        record.parent_size = items[i].parent_size;
+        strings.append(*items[i].name);
+        record.etag_offset = strings.size();
+        record.etag_size = entry.etag.size();
+        strings.append(entry.etag);
+        record.size = entry.size;
+        record.mtime = entry.mtime;
+        record.mode = entry.mode;
+        record.uid = entry.uid;
+        record.gid = entry.gid;
+        record.flags = entry.is_prefix ? FLAG_PREFIX : 0;
+        records.append((const char *) &record, sizeof(record));
+    }
+    Header header;
+    memset(&header, 0, sizeof(header));
+    header.magic = SNAPSHOT_MAGIC;
+    header.version = SNAPSHOT_VERSION;
+    header.count = items.size();
+    header.strings_offset = sizeof(Header) + records.size();
+    header.strings_size = strings.size();
+    header.root_offset = 0;
+    header.root_size = root.size();
+    header.build_time = time(NULL);
+
+    std::string tmp_path = path + ".tmp";
+    int fd = ::open(tmp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        return return_with_error_msg(errmsg, "could not create %s, errno(%d)",
+                tmp_path.c_str(), errno);
+    }
+    int ret = write_all(fd, std::string((const char *) &header, sizeof(header)));
+    if (ret == 0) {
+        ret = write_all(fd, records);
+    }
+    if (ret == 0) {
+        ret = write_all(fd, strings);
+    }
+    if (ret == 0 && fsync(fd) != 0) {
+        ret = -errno;
+    }
+    ::close(fd);
+    if (ret == 0 && rename(tmp_path.c_str(), path.c_str()) != 0) {
+        ret = -errno;
+    }
+    if (ret != 0) {
+        unlink(tmp_path.c_str());
+        return return_with_error_msg(errmsg, "could not write snapshot %s, errno(%d)",
+                path.c_str(), -ret);
+    }
+    BOSFS_INFO("snapshot %s of %s built with %zu entries", path.c_str(), root.c_str(),
+            items.size());
+    return 0;
+}
+
+int NamespaceSnapshot::open(const std::string &path, const std::string &root) {
+    close();
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        int err = errno;
+        BOSFS_ERR("could not open snapshot %s, errno(%d)", path.c_str(), err);
+        return -err;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        int err = errno;
+        ::close(fd);
+        return -err;
+    }
+    if ((size_t) st.st_size < sizeof(Header)) {
+        ::close(fd);
+        BOSFS_ERR("snapshot %s is truncated", path.c_str());
+        return -EINVAL;
+    }
+    void *p = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    int err = errno;
+    ::close(fd);
+    if (p == MAP_FAILED) {
+        BOSFS_ERR("could not map snapshot %s, errno(%d)", path.c_str(), err);
+        return -err;
+    }
+    _map = (char *) p;
+    _map_size = st.st_size;
+    // lookups jump around the file, read ahead would only waste page cache
+    madvise(_map, _map_size, MADV_RANDOM);
+
+    const Header *header = (const Header *) _map;
+    if (header->magic != SNAPSHOT_MAGIC || header->version != SNAPSHOT_VERSION) {
+        BOSFS_ERR("%s is not a snapshot of this version", path.c_str());
+        close();
+        return -EINVAL;
+    }
+    uint64_t records_end = sizeof(Header) + header->count * sizeof(Record);
+    if (header->count > _map_size / sizeof(Record) || records_end > header->strings_offset
+            || header->strings_offset > _map_size
+            || header->strings_size > _map_size - header->strings_offset) {
+        BOSFS_ERR("snapshot %s is truncated", path.c_str());
+        close();
+        return -EINVAL;
+    }
+    _records = (const Record *) (_map + sizeof(Header));
+    _count = header->count;
+    _strings = _map + header->strings_offset;
+    _strings_size = header->strings_size;
+    Bytes built_root = string_at(header->root_offset, header->root_size);
+    if (compare_bytes(built_root.data, built_root.size, root.data(), root.size()) != 0) {
+        BOSFS_ERR("snapshot %s was built for %.*s rather than %s", path.c_str(),
+                (int) built_root.size, built_root.data, root.c_str());
+        close();
+        return -EINVAL;
+    }
+    BOSFS_INFO("snapshot %s of %s opened with %zu entries", path.c_str(), root.c_str(),
+            _count);
+    return 0;
+}
+
+void NamespaceSnapshot::close() {
+    if (_map == NULL) {
+        return;
+    }
+    munmap(_map, _map_size);
+    _map = NULL;
+    _map_size = 0;
+    _records = NULL;
+    _count = 0;
+    _strings = NULL;
+    _strings_size = 0;
+}
+
+NamespaceSnapshot::Bytes NamespaceSnapshot::string_at(uint64_t offset, uint64_t size) const {
+    Bytes bytes = {_strings, 0};
+    if (offset <= _strings_size && size <= _strings_size - offset) {
+        bytes.data = _strings + offset;
+        bytes.size = size;
+    }
+    return bytes;
+}
+
+NamespaceSnapshot::Bytes NamespaceSnapshot::parent_of(const Record &record) const {
+    Bytes name = string_at(record.name_offset, record.name_size);
+    name.size = std::min<size_t>(name.size, record.parent_size);
+    return name;
+}
+
+NamespaceSnapshot::Bytes NamespaceSnapshot::base_of(const Record &record) const {
+    Bytes name = string_at(record.name_offset, record.name_size);
+    size_t offset = std::min(name.size, base_offset_of(record.parent_size));
+    Bytes base = {name.data + offset, name.size - offset};
+    return base;
+}
+
+size_t NamespaceSnapshot::lower_bound(const Bytes &parent, const Bytes &base) const {
+    size_t low = 0;
+    size_t high = _count;
+    while (low < high) {
+        size_t mid = low + (high - low) / 2;
+        Bytes mid_parent = parent_of(_records[mid]);
+        int c = compare_bytes(mid_parent.data, mid_parent.size, parent.data, parent.size);
+        if (c == 0) {
+            Bytes mid_base = base_of(_records[mid]);
+            c = compare_bytes(mid_base.data, mid_base.size, base.data, base.size);
+        }
+        if (c < 0) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    return low;
+}
+
+const NamespaceSnapshot::Record *NamespaceSnapshot::find(const std::string &name) const {
+    if (name.size() < 2 || name[0] != '/') {
+        return NULL;
+    }
+    size_t parent_size = parent_size_of(name);
+    size_t base_offset = base_offset_of(parent_size);
+    Bytes parent = {name.data(), parent_size};
+    Bytes base = {name.data() + base_offset, name.size() - base_offset};
+    size_t i = lower_bound(parent, base);
+    if (i == _count) {
+        return NULL;
+    }
+    Bytes found = string_at(_records[i].name_offset, _records[i].name_size);
+    if (compare_bytes(found.data, found.size, name.data(), name.size()) != 0) {
+        return NULL;
+    }
+    return &_records[i];
+}
+
+bool NamespaceSnapshot::load(File *file) const {
+    const Record *record = find(file->name());
+    if (record == NULL) {
+        return false;
+    }
+    bcesdk_ns::ObjectMetaData meta;
+    meta.set_content_length(record->size);
+    meta.set_last_modified(record->mtime);
+    Bytes etag = string_at(record->etag_offset, record->etag_size);
+    meta.set_etag(std::string(etag.data, etag.size));
+    if (!(record->flags & FLAG_PREFIX)) {
+        meta.set_user_meta("bosfs-mode", (int64_t) record->mode);
+        meta.set_user_meta("bosfs-uid", (int64_t) record->uid);
+        meta.set_user_meta("bosfs-gid", (int64_t) record->gid);
+        meta.set_user_meta("bosfs-mtime", record->mtime);
+    }
+    file->set_meta(meta, true);
+    if (record->flags & FLAG_PREFIX) {
+        file->set_is_prefix(true);
+    } else {
+        file->set_is_dir_obj(S_ISDIR(record->mode));
+    }
+    return true;
+}
+
+bool NamespaceSnapshot::list(const std::string &dir, std::vector<DirEntry> *children) const {
+    if (dir != "/") {
+        const Record *record = find(dir);
+        if (record == NULL || !((record->flags & FLAG_PREFIX) || S_ISDIR(record->mode))) {
+            return false;
+        }
+    }
+    Bytes parent = {dir.data(), dir.size()};
+    Bytes empty = {dir.data(), 0};
+    for (size_t i = lower_bound(parent, empty); i < _count; ++i) {
+        Bytes found = parent_of(_records[i]);
+        if (compare_bytes(found.data, found.size, parent.data, parent.size) != 0) {
+            break;
+        }
+        Bytes base = base_of(_records[i]);
+        bool is_dir = (_records[i].flags & FLAG_PREFIX) || S_ISDIR(_records[i].mode);
+        children->push_back(DirEntry(std::string(base.data, base.size), is_dir));
+    }
+    return true;
+}
+
+END_FS_NAMESPACE
@@ -0,0 +1,102 @@
+/**
+ * bosfs - A fuse-based file system implemented on Baidu Object Storage(BOS)
+ *
+ * Copyright (c) 2016 Baidu.com, Inc. All rights reserved.
+ *
+ * @file    namespace_snapshot.h
+ * @brief   read-only namespace of an immutable prefix, built offline and mapped at mount
+ **/
+#ifndef BAIDU_BOS_BOSFS_NAMESPACE_SNAPSHOT_H
+#define BAIDU_BOS_BOSFS_NAMESPACE_SNAPSHOT_H
+
+#include <stdint.h>
+
+#include <string>
+#include <vector>
+
+#include "common.h"
+
+BEGIN_FS_NAMESPACE
+
+class BosfsUtil;
+class File;
+struct DirEntry;
+
+// every object and directory below the mount point with its size, mtime, mode, owner
+// and etag. records are sorted by parent directory and then base name, so a lookup is a
+// binary search and the children of a directory are adjacent. nothing is read at open,
+// pages of the mapped file are faulted in as they are searched
+class NamespaceSnapshot {
+public:
+    NamespaceSnapshot();
+    ~NamespaceSnapshot();
+
+    // list everything below the mount point of bosfs_util and write it to path
+    static int build(BosfsUtil *bosfs_util, const std::string &path, std::string &errmsg);
+
+    // root is the real path of mount point, it must be the one snapshot was built for
+    int open(const std::string &path, const std::string &root);
+    void close();
+    bool is_open() const { return _map != NULL; }
+
+    // fill file from its record, return false if its name is not in snapshot
+    bool load(File *file) const;
+    // return false if dir is not a directory in snapshot
+    bool list(const std::string &dir, std::vector<DirEntry> *children) const;
+
+private:
+    enum {
+        SNAPSHOT_MAGIC = 0x31534e42,    // "BNS1"
+        SNAPSHOT_VERSION = 1
+    };
+    enum { FLAG_PREFIX = 1 };
+    struct Header {
+        uint32_t magic;
+        uint32_t version;
+        uint64_t count;
+        uint64_t strings_offset;
+        uint64_t strings_size;
+        uint64_t root_offset;       // in string area
+        uint32_t root_size;
+        uint32_t reserved;
+        int64_t build_time;
+    };
+    // records follow the header
+    struct Record {
+        uint64_t name_offset;       // in string area
+        uint64_t etag_offset;
+        int64_t size;
+        int64_t mtime;
+        uint32_t name_size;
+        uint32_t parent_size;       // name[0, parent_size) is the parent directory
+        uint32_t etag_size;
+        uint32_t mode;
+        uint32_t uid;
+        uint32_t gid;
+        uint32_t flags;
+        uint32_t reserved;
+    };
+    struct Bytes {
+        const char *data;
+        size_t size;
+    };
+
+    // empty if out of the string area, a broken record is simply never found
+    Bytes string_at(uint64_t offset, uint64_t size) const;
+    Bytes parent_of(const Record &record) const;
+    Bytes base_of(const Record &record) const;
+    // first record not ordered before (parent, base)
+    size_t lower_bound(const Bytes &parent, const Bytes &base) const;
+    const Record *find(const std::string &name) const;
+
+    char *_map;
+    size_t _map_size;
+    const Record *_records;
+    size_t _count;
+    const char *_strings;
+    size_t _strings_size;
+};
+
+END_FS_NAMESPACE
+
+#endif
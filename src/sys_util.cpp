@@ -21,6 +21,10 @@
 #include <sstream>
 #include <pthread.h>
 
+#include <algorithm>
+#include <unordered_map>
+#include <vector>
+
 #include <sys/types.h>
 #include <sys/stat.h>
 
@@ -30,88 +34,174 @@ const char *        SysUtil::_s_default_mime_file = "/etc/mime.types";
 SysUtil::mimes_t  SysUtil::_s_mime_types;
 bool SysUtil::_s_is_mime_types_initialized = false;
 
-std::string SysUtil::get_username(uid_t uid)
-{
-    std::string ret("");
-    static size_t max_len = 0;
-    if (0 == max_len) {
-        long res = sysconf(_SC_GETPW_R_SIZE_MAX);
-        if (res < 0) {
-            BOSFS_WARN("%s", "Could not get max pw length!");
-            max_len = 0;
-            return ret;
+// users and their groups as resolved through NSS, which is a network round trip on
+// LDAP/sssd hosts, so results are kept for a while in a table sharded by uid
+class IdentityCache {
+public:
+    IdentityCache() {
+        for (int i = 0; i < SHARD_NUM; ++i) {
+            pthread_rwlock_init(&_shards[i].lock, NULL);
         }
-        max_len = res;
     }
-
-    char *buf = NULL;
-    if (NULL == (buf = (char *)malloc(sizeof(char) * max_len))) {
-        BOSFS_ERR("%s", "Failed to allocate memory!");
-        free(buf);
-        return ret;
+    ~IdentityCache() {
+        for (int i = 0; i < SHARD_NUM; ++i) {
+            pthread_rwlock_destroy(&_shards[i].lock);
+        }
     }
 
-    struct passwd pwinfo;
-    struct passwd *ppwinfo = NULL;
-    if (0 != getpwuid_r(uid, &pwinfo, buf, max_len, &ppwinfo)) {
-        BOSFS_WARN("%s", "Could not get pw information!");
-        free(buf);
-        return ret;
-    }
+    // return 0 if uid is unknown to NSS and an empty name is returned
+    int get_username(uid_t uid, std::string *username) {
+        Shard &shard = _shards[uid % SHARD_NUM];
+        int64_t now = get_system_time_s();
+        pthread_rwlock_rdlock(&shard.lock);
+        const Identity *identity = find(shard, uid, now);
+        if (identity != NULL) {
+            *username = identity->username;
+            pthread_rwlock_unlock(&shard.lock);
+            return 0;
+        }
+        pthread_rwlock_unlock(&shard.lock);
 
-    if (NULL == ppwinfo) {
-        free(buf);
-        return ret;
+        Identity fresh;
+        int ret = resolve(uid, &fresh);
+        if (ret != 0) {
+            return ret;
+        }
+        *username = fresh.username;
+        insert(shard, uid, fresh);
+        return 0;
     }
-    ret = ppwinfo->pw_name;
-    free(buf);
-    return ret;
-}
 
-int SysUtil::is_uid_in_group(uid_t uid, gid_t gid)
-{
-    int result = 0;
-    static size_t max_len = 0;
-    if (0 == max_len) {
-        long res = sysconf(_SC_GETGR_R_SIZE_MAX);
-        if (res < 0) {
-            BOSFS_ERR("%s", "Could not get max name length!");
-            max_len = 0;
-            return -ERANGE;
+    // return 1 if gid is the primary or a supplementary group of uid, 0 if not or if
+    // uid is unknown, negative errno if uid can not be looked up
+    int is_member(uid_t uid, gid_t gid) {
+        Shard &shard = _shards[uid % SHARD_NUM];
+        int64_t now = get_system_time_s();
+        pthread_rwlock_rdlock(&shard.lock);
+        const Identity *identity = find(shard, uid, now);
+        if (identity != NULL) {
+            int result = std::binary_search(identity->groups.begin(), identity->groups.end(),
+                    gid) ? 1 : 0;
+            pthread_rwlock_unlock(&shard.lock);
+            return result;
         }
-        max_len = res;
+        pthread_rwlock_unlock(&shard.lock);
+
+        Identity fresh;
+        int ret = resolve(uid, &fresh);
+        if (ret != 0) {
+            return ret;
+        }
+        int result = std::binary_search(fresh.groups.begin(), fresh.groups.end(), gid) ? 1 : 0;
+        insert(shard, uid, fresh);
+        return result;
     }
 
-    char * buf = NULL;
-    if (NULL ==(buf = (char *)malloc(sizeof(char) * max_len))) {
-        BOSFS_ERR("%s", "Failed to allocate memory!");
-        free(buf);
-        return -ENOMEM;
+private:
+    enum {
+        SHARD_NUM = 16,
+        SHARD_CAPACITY = 4096,
+        EXPIRE_S = 300
+    };
+    struct Identity {
+        std::string username;       // empty if uid is unknown
+        std::vector<gid_t> groups;  // sorted
+        int64_t load_time_s;
+    };
+    struct Shard {
+        pthread_rwlock_t lock;
+        std::unordered_map<uid_t, Identity> table;
+    };
+
+    // must be called with shard lock held
+    const Identity *find(Shard &shard, uid_t uid, int64_t now) {
+        std::unordered_map<uid_t, Identity>::const_iterator it = shard.table.find(uid);
+        if (it == shard.table.end() || it->second.load_time_s + EXPIRE_S < now) {
+            return NULL;
+        }
+        return &it->second;
     }
 
-    struct group ginfo;
-    struct group *pginfo = NULL;
-    if (0 != (result = getgrgid_r(gid, &ginfo, buf, max_len, &pginfo))) {
-        BOSFS_ERR("%s", "Could not get group information!");
-        free(buf);
-        return -result;
+    void insert(Shard &shard, uid_t uid, Identity &identity) {
+        pthread_rwlock_wrlock(&shard.lock);
+        if (shard.table.size() >= SHARD_CAPACITY && shard.table.find(uid) == shard.table.end()) {
+            evict(shard, identity.load_time_s);
+        }
+        Identity &slot = shard.table[uid];
+        slot.username.swap(identity.username);
+        slot.groups.swap(identity.groups);
+        slot.load_time_s = identity.load_time_s;
+        pthread_rwlock_unlock(&shard.lock);
     }
 
-    if (NULL == pginfo) {
-        free(buf);
-        return -EINVAL;
+    // must be called with shard lock held. expired entries go first, then the oldest
+    // one if none has, so a full shard does not lose all its users at once
+    void evict(Shard &shard, int64_t now) {
+        std::unordered_map<uid_t, Identity>::iterator oldest = shard.table.end();
+        for (std::unordered_map<uid_t, Identity>::iterator it = shard.table.begin();
+                it != shard.table.end(); ) {
+            if (it->second.load_time_s + EXPIRE_S < now) {
+                it = shard.table.erase(it);
+                continue;
+            }
+            if (oldest == shard.table.end()
+                    || it->second.load_time_s < oldest->second.load_time_s) {
+                oldest = it;
+            }
+            ++it;
+        }
+        if (shard.table.size() >= SHARD_CAPACITY && oldest != shard.table.end()) {
+            shard.table.erase(oldest);
+        }
     }
 
-    std::string username = get_username(uid);
-    char ** ppgr;
-    for (ppgr = pginfo->gr_mem; ppgr && *ppgr; ++ppgr) {
-        if (username == *ppgr) {
-            free(buf);
-            return 1;
+    static int resolve(uid_t uid, Identity *identity) {
+        identity->load_time_s = get_system_time_s();
+        long res = sysconf(_SC_GETPW_R_SIZE_MAX);
+        std::vector<char> buf(res > 0 ? res : 16384);
+        struct passwd pwinfo;
+        struct passwd *ppwinfo = NULL;
+        int ret = 0;
+        while ((ret = getpwuid_r(uid, &pwinfo, &buf[0], buf.size(), &ppwinfo)) == ERANGE) {
+            buf.resize(buf.size() * 2);
         }
+        if (ret != 0) {
+            BOSFS_WARN("Could not get pw information of uid %u, errno(%d)", uid, ret);
+            return -ret;
+        }
+        if (NULL == ppwinfo) {
+            // unknown users are remembered as well
+            return 0;
+        }
+        identity->username = ppwinfo->pw_name;
+        int ngroups = 32;
+        std::vector<gid_t> groups(ngroups);
+        while (getgrouplist(ppwinfo->pw_name, ppwinfo->pw_gid, &groups[0], &ngroups) < 0) {
+            // ngroups is set to the number needed
+            ngroups = std::max<int>(ngroups, groups.size() * 2);
+            groups.resize(ngroups);
+        }
+        groups.resize(ngroups);
+        std::sort(groups.begin(), groups.end());
+        identity->groups.swap(groups);
+        return 0;
     }
-    free(buf);
-    return 0;
+
+    Shard _shards[SHARD_NUM];
+};
+
+static IdentityCache s_identity_cache;
+
+std::string SysUtil::get_username(uid_t uid)
+{
+    std::string ret("");
+    s_identity_cache.get_username(uid, &ret);
+    return ret;
+}
+
+int SysUtil::is_uid_in_group(uid_t uid, gid_t gid)
+{
+    return s_identity_cache.is_member(uid, gid);
 }
 
 std::string SysUtil::bosfs_basename(const char *path)
@@ -15,6 +15,9 @@
 #include <sys/time.h>
 #include <pthread.h>
 
+#include <atomic>
+#include <utility>
+
 #define BOSFS_FATAL(fmt, ...) LOGF(FATAL, fmt, ##__VA_ARGS__)
 #define BOSFS_ERR(fmt, ...) LOGF(ERROR, fmt, ##__VA_ARGS__)
 #define BOSFS_WARN(fmt, ...) LOGF(WARN, fmt, ##__VA_ARGS__)
@@ -112,106 +115,80 @@ private:
     T *_p;
 };
 
-class Ref {
-public:
-    Ref() : _cnt(1) {
-        pthread_mutex_init(&_lock, NULL);
-    }
-    ~Ref() {
-        pthread_mutex_destroy(&_lock);
-    }
-
-    // return before
-    int add() {
-        pthread_mutex_lock(&_lock);
-        int tmp = _cnt++;
-        pthread_mutex_unlock(&_lock);
-        return tmp;
-    }
-
-    // return remains
-    int dec() {
-        pthread_mutex_lock(&_lock);
-        int tmp = --_cnt;
-        pthread_mutex_unlock(&_lock);
-        return tmp;
-    }
-
-    int count() {
-        pthread_mutex_lock(&_lock);
-        int tmp = _cnt;
-        pthread_mutex_unlock(&_lock);
-        return tmp;
-    }
-
-private:
-    pthread_mutex_t _lock;
-    int _cnt;
-};
-
+// refcounted pointer keeping the count and the object in one allocation, created by
+// make_ref(). copies and releases only touch an atomic counter
 template<typename T>
-class SharedPtr {
+class RefPtr {
 public:
-    SharedPtr() {
-        _p = NULL;
-        _ref = NULL;
-    }
-    SharedPtr(T *p) {
-        _p = p;
-        _ref = new Ref();
-    }
-    SharedPtr(const SharedPtr &ptr) {
-        _p = ptr._p;
-        _ref = ptr._ref;
-        if (_ref != NULL) {
-            _ref->add();
+    RefPtr() : _block(NULL) {}
+    RefPtr(const RefPtr &ptr) : _block(ptr._block) {
+        if (_block != NULL) {
+            _block->count.fetch_add(1, std::memory_order_relaxed);
         }
     }
-    ~SharedPtr() {
-        reset();
+    RefPtr(RefPtr &&ptr) : _block(ptr._block) {
+        ptr._block = NULL;
+    }
+    ~RefPtr() {
+        release();
     }
 
-    SharedPtr &operator=(const SharedPtr &ptr) {
-        reset();
-        _p = ptr._p;
-        _ref = ptr._ref;
-        if (_ref != NULL) {
-            _ref->add();
-        }
+    RefPtr &operator=(const RefPtr &ptr) {
+        RefPtr tmp(ptr);
+        swap(tmp);
+        return *this;
+    }
+    RefPtr &operator=(RefPtr &&ptr) {
+        RefPtr tmp(std::move(ptr));
+        swap(tmp);
         return *this;
     }
 
-    T *get() { return _p; }
-    const T *get() const { return _p; }
+    template<typename... Args>
+    static RefPtr make(Args&&... args) {
+        return RefPtr(new Block(std::forward<Args>(args)...));
+    }
 
+    void swap(RefPtr &ptr) { std::swap(_block, ptr._block); }
     void reset() {
-        if (_ref != NULL && _ref->dec() == 0) {
-            delete _ref;
-            if (_p != NULL) {
-                delete _p;
-            }
-        }
-    }
-    void reset(T *p) {
-        reset();
-        _p = p;
-        _ref = new Ref();
+        release();
+        _block = NULL;
     }
 
-    int refcount() {
-        return _ref->count();
+    T *get() { return _block != NULL ? &_block->value : NULL; }
+    const T *get() const { return _block != NULL ? &_block->value : NULL; }
+    int refcount() const {
+        return _block != NULL ? _block->count.load(std::memory_order_acquire) : 0;
     }
 
-    inline const T &operator *() const { return *_p; }
-    inline const T *operator -> () const { return _p; }
+    inline const T &operator *() const { return _block->value; }
+    inline const T *operator -> () const { return &_block->value; }
 
-    inline T &operator *() { return *_p; }
-    inline T *operator -> () { return _p; }
+    inline T &operator *() { return _block->value; }
+    inline T *operator -> () { return &_block->value; }
 private:
-    T *_p;
-    Ref *_ref;
+    struct Block {
+        template<typename... Args>
+        explicit Block(Args&&... args) : count(1), value(std::forward<Args>(args)...) {}
+        std::atomic<int> count;
+        T value;
+    };
+
+    explicit RefPtr(Block *block) : _block(block) {}
+    void release() {
+        if (_block != NULL && _block->count.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+            delete _block;
+        }
+    }
+
+    Block *_block;
 };
 
+template<typename T, typename... Args>
+inline RefPtr<T> make_ref(Args&&... args) {
+    return RefPtr<T>::make(std::forward<Args>(args)...);
+}
+
 class MutexGuard {
 public:
     MutexGuard(pthread_mutex_t *lock) {
@@ -0,0 +1,106 @@
+/**
+ * bosfs - A fuse-based file system implemented on Baidu Object Storage(BOS)
+ *
+ * Copyright (c) 2016 Baidu.com, Inc. All rights reserved.
+ *
+ * @file    bench_file_manager.cpp
+ * @brief   throughput of FileManager lookups and updates under contention
+ **/
+#include <stdio.h>
+
+#include <string>
+#include <vector>
+
+#include "bosfs_lib/bosfs_lib.h"
+#include "bosfs_util.h"
+#include "file_manager.h"
+#include "bench_util.h"
+
+using namespace baidu::bos::bosfs;
+
+// every thread looks up random cached names, one in update_ratio operations replaces or
+// drops and re-adds an entry instead, the way getattr and writes mix on a busy mount
+struct Workload {
+    BosfsUtil *util;
+    FileManager *file_manager;
+    const std::vector<std::string> *names;
+    int ops;
+    int update_ratio;
+    std::vector<int> misses;
+
+    void operator()(int index) {
+        uint64_t state = 0x9e3779b97f4a7c15ULL * (index + 1);
+        int missed = 0;
+        for (int i = 0; i < ops; ++i) {
+            uint64_t r = bench_rand(&state);
+            const std::string &name = (*names)[r % names->size()];
+            if (update_ratio > 0 && (r >> 32) % update_ratio == 0) {
+                FilePtr file = make_ref<File>(util, name);
+                if ((r >> 40) & 1) {
+                    file_manager->del(name);
+                }
+                file_manager->set(name, file);
+                continue;
+            }
+            FilePtr file;
+            if (!file_manager->try_get(name, &file)) {
+                ++missed;
+            }
+        }
+        misses[index] = missed;
+    }
+};
+
+int main(int argc, char *argv[]) {
+    int max_threads = bench_arg(argc, argv, 1, 32);
+    int entries = bench_arg(argc, argv, 2, 200000);
+    int ops = bench_arg(argc, argv, 3, 1000000);
+    int update_ratio = bench_arg(argc, argv, 4, 20);
+    if (max_threads <= 0 || entries <= 0 || ops <= 0) {
+        fprintf(stderr, "usage: %s [max_threads] [entries] [ops_per_thread] "
+                "[update_ratio, 0 for lookups only]\n", argv[0]);
+        return 1;
+    }
+
+    BosfsUtil util;
+    FileManager file_manager(&util);
+    util.set_file_manager(&file_manager);
+    // long paths of a deep tree, like those an ls -lR walks through
+    std::vector<std::string> names;
+    char buf[256];
+    for (int i = 0; i < entries; ++i) {
+        snprintf(buf, sizeof(buf), "/bench/project-%03d/src/module-%04d/file-%08d.dat",
+                i % 97, i % 1009, i);
+        names.push_back(buf);
+        bcesdk_ns::ObjectMetaData meta;
+        meta.set_content_length(i);
+        meta.set_user_meta("bosfs-mode", 0100644);
+        FilePtr file = make_ref<File>(&util, names.back());
+        file->set_meta(meta);
+        file_manager.set(names.back(), file);
+    }
+
+    printf("%d entries, %d ops per thread, 1 update in %d ops\n", entries, ops, update_ratio);
+    printf("%8s %12s %12s %10s\n", "threads", "Mops/s", "ns/op", "misses");
+    for (int threads = 1; threads <= max_threads; threads *= 2) {
+        Workload workload;
+        workload.util = &util;
+        workload.file_manager = &file_manager;
+        workload.names = &names;
+        workload.ops = ops;
+        workload.update_ratio = update_ratio;
+        workload.misses.assign(threads, 0);
+        int64_t elapsed = bench_run_threads(threads, workload);
+        int64_t misses = 0;
+        for (int i = 0; i < threads; ++i) {
+            misses += workload.misses[i];
+        }
+        double total = static_cast<double>(ops) * threads;
+        printf("%8d %12.2f %12.1f %10lld\n", threads, total * 1000 / elapsed,
+                static_cast<double>(elapsed) * threads / total, (long long) misses);
+        if (threads < max_threads && threads * 2 > max_threads) {
+            threads = max_threads / 2;
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,96 @@
+/**
+ * bosfs - A fuse-based file system implemented on Baidu Object Storage(BOS)
+ *
+ * Copyright (c) 2016 Baidu.com, Inc. All rights reserved.
+ *
+ * @file    bench_file_stat.cpp
+ * @brief   per call cost of File::stat against parsing meta into a snapshot
+ **/
+#include <stdio.h>
+#include <sys/stat.h>
+
+#include <vector>
+
+#include "bosfs_lib/bosfs_lib.h"
+#include "bosfs_util.h"
+#include "file_manager.h"
+#include "bench_util.h"
+
+using namespace baidu::bos::bosfs;
+
+// many threads stat one hot file, as parallel getattr of one path does
+struct SharedStat {
+    FilePtr file;
+    int calls;
+    std::vector<int64_t> checksums;
+
+    void operator()(int index) {
+        struct stat st;
+        int64_t checksum = 0;
+        for (int i = 0; i < calls; ++i) {
+            file->stat(&st);
+            checksum += st.st_mode + st.st_mtime;
+        }
+        checksums[index] = checksum;
+    }
+};
+
+int main(int argc, char *argv[]) {
+    int calls = bench_arg(argc, argv, 1, 10000000);
+    int max_threads = bench_arg(argc, argv, 2, 8);
+    if (calls <= 0 || max_threads <= 0) {
+        fprintf(stderr, "usage: %s [calls] [max_threads]\n", argv[0]);
+        return 1;
+    }
+
+    BosfsUtil util;
+    // what a file written through bosfs carries
+    bcesdk_ns::ObjectMetaData meta;
+    meta.set_content_length(123456789);
+    meta.set_last_modified(1480000000);
+    meta.set_etag("d41d8cd98f00b204e9800998ecf8427e");
+    meta.set_content_type("application/octet-stream");
+    meta.set_user_meta("bosfs-mtime", 1480000001);
+    meta.set_user_meta("bosfs-uid", 1000);
+    meta.set_user_meta("bosfs-gid", 1000);
+    meta.set_user_meta("bosfs-mode", 0100755);
+    FilePtr file = make_ref<File>(&util, "/bench/file");
+
+    // parsing is paid once per load, a HEAD or a meta store record
+    int parses = calls / 10 > 0 ? calls / 10 : 1;
+    int64_t start = bench_now_ns();
+    for (int i = 0; i < parses; ++i) {
+        file->set_meta(meta);
+    }
+    int64_t parse_ns = bench_now_ns() - start;
+
+    // stat is paid on every getattr
+    struct stat st;
+    int64_t checksum = 0;
+    start = bench_now_ns();
+    for (int i = 0; i < calls; ++i) {
+        file->stat(&st);
+        checksum += st.st_mode + st.st_mtime;
+    }
+    int64_t stat_ns = bench_now_ns() - start;
+    if (st.st_mode != 0100755 || st.st_uid != 1000 || st.st_mtime != 1480000001) {
+        fprintf(stderr, "unexpected stat: mode %o uid %d mtime %ld\n",
+                st.st_mode, st.st_uid, (long) st.st_mtime);
+        return 1;
+    }
+
+    printf("%-24s %10.1f ns/call\n", "parse meta (per load)",
+            static_cast<double>(parse_ns) / parses);
+    printf("%-24s %10.1f ns/call (checksum %lld)\n", "stat (per getattr)",
+            static_cast<double>(stat_ns) / calls, (long long) checksum);
+    for (int threads = 2; threads <= max_threads; threads *= 2) {
+        SharedStat shared;
+        shared.file = file;
+        shared.calls = calls;
+        shared.checksums.assign(threads, 0);
+        int64_t elapsed = bench_run_threads(threads, shared);
+        printf("stat on %2d threads        %10.1f ns/call\n", threads,
+                static_cast<double>(elapsed) / calls);
+    }
+    return 0;
+}
@@ -0,0 +1,168 @@
+/**
+ * bosfs - A fuse-based file system implemented on Baidu Object Storage(BOS)
+ *
+ * Copyright (c) 2016 Baidu.com, Inc. All rights reserved.
+ *
+ * @file    bench_getattr.cpp
+ * @brief   getattr throughput on cached entries and the cost of pointer copies in it
+ **/
+#include <stdio.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include <string>
+#include <vector>
+
+#include "bosfs_lib/bosfs_lib.h"
+#include "bosfs_util.h"
+#include "file_manager.h"
+#include "bench_util.h"
+
+using namespace baidu::bos::bosfs;
+
+// the shared pointer FilePtr used to be: the count lives in an allocation of its own and
+// every copy, release and refcount() takes its mutex. kept here as the baseline
+template<typename T>
+class LockedPtr {
+public:
+    LockedPtr() : _p(NULL), _ref(NULL) {}
+    explicit LockedPtr(T *p) : _p(p), _ref(new Ref()) {}
+    LockedPtr(const LockedPtr &ptr) : _p(ptr._p), _ref(ptr._ref) {
+        if (_ref != NULL) {
+            _ref->add();
+        }
+    }
+    ~LockedPtr() {
+        if (_ref != NULL && _ref->dec() == 0) {
+            delete _ref;
+            delete _p;
+        }
+    }
+    T *get() { return _p; }
+
+private:
+    LockedPtr &operator=(const LockedPtr &);
+
+    class Ref {
+    public:
+        Ref() : _cnt(1) { pthread_mutex_init(&_lock, NULL); }
+        ~Ref() { pthread_mutex_destroy(&_lock); }
+        void add() {
+            MutexGuard lock(&_lock);
+            ++_cnt;
+        }
+        int dec() {
+            MutexGuard lock(&_lock);
+            return --_cnt;
+        }
+    private:
+        pthread_mutex_t _lock;
+        int _cnt;
+    };
+
+    T *_p;
+    Ref *_ref;
+};
+
+// every thread copies and drops one hot pointer, as try_get does for a hot path
+template<typename Ptr>
+struct PointerCopy {
+    const Ptr *source;
+    int ops;
+    std::vector<int64_t> sums;
+
+    void operator()(int index) {
+        int64_t sum = 0;
+        for (int i = 0; i < ops; ++i) {
+            Ptr copy(*source);
+            sum += *copy.get();
+        }
+        sums[index] = sum;
+    }
+};
+
+// every thread stats random cached names through the path getattr takes
+struct Getattr {
+    BosfsUtil *util;
+    const std::vector<std::string> *names;
+    int ops;
+    std::vector<int> failures;
+
+    void operator()(int index) {
+        uint64_t state = 0x9e3779b97f4a7c15ULL * (index + 1);
+        int failed = 0;
+        struct stat st;
+        for (int i = 0; i < ops; ++i) {
+            const std::string &name = (*names)[bench_rand(&state) % names->size()];
+            if (util->get_object_attribute(name, &st) != 0) {
+                ++failed;
+            }
+        }
+        failures[index] = failed;
+    }
+};
+
+template<typename Body>
+static void report(const char *what, int threads, int ops, Body &body) {
+    int64_t elapsed = bench_run_threads(threads, body);
+    double total = static_cast<double>(ops) * threads;
+    printf("%-12s %8d %12.2f %12.1f\n", what, threads, total * 1000 / elapsed,
+            static_cast<double>(elapsed) * threads / total);
+}
+
+int main(int argc, char *argv[]) {
+    int max_threads = bench_arg(argc, argv, 1, 32);
+    int entries = bench_arg(argc, argv, 2, 100000);
+    int ops = bench_arg(argc, argv, 3, 2000000);
+    if (max_threads <= 0 || entries <= 0 || ops <= 0) {
+        fprintf(stderr, "usage: %s [max_threads] [entries] [ops_per_thread]\n", argv[0]);
+        return 1;
+    }
+
+    BosfsUtil util;
+    FileManager file_manager(&util);
+    util.set_file_manager(&file_manager);
+    std::vector<std::string> names;
+    char buf[256];
+    for (int i = 0; i < entries; ++i) {
+        snprintf(buf, sizeof(buf), "/bench/dir-%04d/file-%08d", i % 1009, i);
+        names.push_back(buf);
+        bcesdk_ns::ObjectMetaData meta;
+        meta.set_content_length(i);
+        meta.set_user_meta("bosfs-mode", 0100644);
+        FilePtr file = make_ref<File>(&util, names.back());
+        file->set_meta(meta);
+        file_manager.set(names.back(), file);
+    }
+
+    LockedPtr<int> locked(new int(1));
+    RefPtr<int> ref = make_ref<int>(1);
+    printf("%-12s %8s %12s %12s\n", "", "threads", "Mops/s", "ns/op");
+    for (int threads = 1; threads <= max_threads; threads *= 2) {
+        PointerCopy<LockedPtr<int> > locked_copy;
+        locked_copy.source = &locked;
+        locked_copy.ops = ops;
+        locked_copy.sums.assign(threads, 0);
+        report("mutex copy", threads, ops, locked_copy);
+
+        PointerCopy<RefPtr<int> > ref_copy;
+        ref_copy.source = &ref;
+        ref_copy.ops = ops;
+        ref_copy.sums.assign(threads, 0);
+        report("atomic copy", threads, ops, ref_copy);
+
+        Getattr getattr;
+        getattr.util = &util;
+        getattr.names = &names;
+        getattr.ops = ops;
+        getattr.failures.assign(threads, 0);
+        report("getattr", threads, ops, getattr);
+        for (int i = 0; i < threads; ++i) {
+            if (getattr.failures[i] != 0) {
+                fprintf(stderr, "getattr missed %d cached entries\n", getattr.failures[i]);
+                return 1;
+            }
+        }
+    }
+    return 0;
+}
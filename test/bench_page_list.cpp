@@ -0,0 +1,221 @@
+/**
+ * bosfs - A fuse-based file system implemented on Baidu Object Storage(BOS)
+ *
+ * Copyright (c) 2016 Baidu.com, Inc. All rights reserved.
+ *
+ * @file    bench_page_list.cpp
+ * @brief   ObjectPageList checked against a byte map, then timed on fragmented lists
+ **/
+#include <stdio.h>
+
+#include <algorithm>
+#include <utility>
+#include <vector>
+
+#include "bosfs_lib/bosfs_lib.h"
+#include "data_cache.h"
+#include "bench_util.h"
+
+using namespace baidu::bos::bosfs;
+
+typedef std::vector<std::pair<off_t, size_t> > RangeList;
+
+// one flag per byte, what ObjectPageList has to agree with however it keeps its pages
+class PageModel {
+public:
+    PageModel(size_t size, bool loaded) : _loaded(size, loaded) {}
+
+    size_t get_size() const { return _loaded.size(); }
+    void resize(size_t size, bool loaded) { _loaded.resize(size, loaded); }
+    void set_page_loaded_status(off_t start, size_t size, bool loaded) {
+        if (_loaded.size() < start + size) {
+            _loaded.resize(start + size, false);
+        }
+        for (size_t i = start; i < start + size; ++i) {
+            _loaded[i] = loaded;
+        }
+    }
+    // size 0 stands for up to the end
+    bool is_page_loaded(off_t start, size_t size) const {
+        for (size_t i = start; i < end_of(start, size); ++i) {
+            if (!_loaded[i]) {
+                return false;
+            }
+        }
+        return true;
+    }
+    size_t get_total_unloaded_page_size(off_t start, size_t size) const {
+        size_t total = 0;
+        for (size_t i = start; i < std::min(_loaded.size(), start + size); ++i) {
+            total += _loaded[i] ? 0 : 1;
+        }
+        return total;
+    }
+    // size 0 stands for up to the end
+    RangeList get_unloaded_pages(off_t start, size_t size) const {
+        RangeList ranges;
+        for (size_t i = start; i < end_of(start, size); ++i) {
+            if (_loaded[i]) {
+                continue;
+            }
+            if (!ranges.empty() && ranges.back().first + ranges.back().second == i) {
+                ++ranges.back().second;
+            } else {
+                ranges.push_back(std::make_pair(static_cast<off_t>(i), 1));
+            }
+        }
+        return ranges;
+    }
+    // the whole unloaded run reaching past start, or the first one after it
+    bool find_unloaded_pate(off_t start, off_t &ret_start, size_t &ret_size) const {
+        RangeList runs = get_unloaded_pages(0, 0);
+        for (size_t i = 0; i < runs.size(); ++i) {
+            off_t last = runs[i].first + runs[i].second - 1;
+            if (last > start) {
+                ret_start = runs[i].first;
+                ret_size = runs[i].second;
+                return true;
+            }
+        }
+        return false;
+    }
+
+private:
+    size_t end_of(off_t start, size_t size) const {
+        return size == 0 ? _loaded.size() : std::min(_loaded.size(), start + size);
+    }
+
+    std::vector<bool> _loaded;
+};
+
+static RangeList to_ranges(const ObjectPageList::self_type &pages) {
+    RangeList ranges;
+    for (size_t i = 0; i < pages.size(); ++i) {
+        ranges.push_back(std::make_pair(pages[i].get_offset(),
+                static_cast<size_t>(pages[i].get_bytes())));
+    }
+    return ranges;
+}
+
+// random small lists driven through the same calls as the model, every query compared
+static bool check(int rounds) {
+    uint64_t state = 0x2545f4914f6cdd1dULL;
+    for (int round = 0; round < rounds; ++round) {
+        size_t size = bench_rand(&state) % 200;
+        bool loaded = bench_rand(&state) & 1;
+        ObjectPageList list(size, loaded);
+        PageModel model(size, loaded);
+        for (int step = 0; step < 60; ++step) {
+            int op = bench_rand(&state) % 6;
+            off_t start = bench_rand(&state) % 260;
+            size_t bytes = bench_rand(&state) % 50;
+            bool flag = bench_rand(&state) & 1;
+            if (op < 3) {
+                list.set_page_loaded_status(start, bytes, flag);
+                model.set_page_loaded_status(start, bytes, flag);
+            } else if (op == 3) {
+                list.resize(start, flag);
+                model.resize(start, flag);
+            }
+            const char *failed = NULL;
+            ObjectPageList::self_type unloaded;
+            list.get_unloaded_pages(unloaded, start, bytes);
+            off_t found_start = 0;
+            size_t found_size = 0;
+            bool found = list.find_unloaded_pate(start, found_start, found_size);
+            off_t model_start = 0;
+            size_t model_size = 0;
+            bool model_found = model.find_unloaded_pate(start, model_start, model_size);
+            if (list.get_size() != model.get_size()) {
+                failed = "get_size";
+            } else if (list.is_page_loaded(start, bytes) != model.is_page_loaded(start, bytes)) {
+                failed = "is_page_loaded";
+            } else if (list.get_total_unloaded_page_size(start, bytes)
+                    != model.get_total_unloaded_page_size(start, bytes)) {
+                failed = "get_total_unloaded_page_size";
+            } else if (to_ranges(unloaded) != model.get_unloaded_pages(start, bytes)) {
+                failed = "get_unloaded_pages";
+            } else if (found != model_found || found_start != model_start
+                    || found_size != model_size) {
+                failed = "find_unloaded_pate";
+            }
+            if (failed != NULL) {
+                fprintf(stderr, "%s differs from model in round %d step %d, start %lld "
+                        "bytes %zu\n", failed, round, step, (long long) start, bytes);
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+int main(int argc, char *argv[]) {
+    int fragments = bench_arg(argc, argv, 1, 50000);
+    int ops = bench_arg(argc, argv, 2, 1000000);
+    int rounds = bench_arg(argc, argv, 3, 3000);
+    if (fragments <= 0 || ops <= 0 || rounds < 0) {
+        fprintf(stderr, "usage: %s [fragments] [ops] [check_rounds]\n", argv[0]);
+        return 1;
+    }
+    if (!check(rounds)) {
+        return 1;
+    }
+    printf("%d rounds agree with the model\n", rounds);
+
+    // a 4GB file read at random 64KB blocks, only even ones so no two loaded blocks merge
+    const size_t block = 65536;
+    size_t file_size = 4ULL << 30;
+    ObjectPageList list(file_size, false);
+    uint64_t state = 0x9e3779b97f4a7c15ULL;
+    size_t blocks = file_size / block;
+    int64_t start = bench_now_ns();
+    for (int i = 0; i < fragments; ++i) {
+        off_t offset = (bench_rand(&state) % (blocks / 2)) * 2 * block;
+        list.set_page_loaded_status(offset, block, true);
+    }
+    int64_t build_ns = bench_now_ns() - start;
+    size_t unloaded = list.get_total_unloaded_page_size(0, file_size);
+    printf("%d fragments set in %.1f ns each, %zu bytes left unloaded\n", fragments,
+            static_cast<double>(build_ns) / fragments, unloaded);
+
+    int64_t hits = 0;
+    start = bench_now_ns();
+    for (int i = 0; i < ops; ++i) {
+        off_t offset = bench_rand(&state) % (file_size - block);
+        hits += list.is_page_loaded(offset, 4096) ? 1 : 0;
+    }
+    int64_t loaded_ns = bench_now_ns() - start;
+
+    int64_t pages = 0;
+    start = bench_now_ns();
+    for (int i = 0; i < ops; ++i) {
+        off_t offset = bench_rand(&state) % (file_size - 16 * block);
+        ObjectPageList::self_type unloaded_list;
+        pages += list.get_unloaded_pages(unloaded_list, offset, 16 * block);
+    }
+    int64_t unloaded_ns = bench_now_ns() - start;
+
+    // a read loads a block and frees it again, the list keeps its shape. each one moves
+    // the pages behind it, so fewer are run
+    int updates = ops / 10 > 0 ? ops / 10 : 1;
+    start = bench_now_ns();
+    for (int i = 0; i < updates; ++i) {
+        off_t offset = (bench_rand(&state) % blocks) * block;
+        bool was_loaded = list.is_page_loaded(offset, block);
+        list.set_page_loaded_status(offset, block, !was_loaded);
+        list.set_page_loaded_status(offset, block, was_loaded);
+    }
+    int64_t update_ns = bench_now_ns() - start;
+    if (list.get_total_unloaded_page_size(0, file_size) != unloaded) {
+        fprintf(stderr, "toggling blocks changed what is loaded\n");
+        return 1;
+    }
+
+    printf("%-36s %10.1f ns/op (%lld hits)\n", "is_page_loaded 4KB",
+            static_cast<double>(loaded_ns) / ops, (long long) hits);
+    printf("%-36s %10.1f ns/op (%lld ranges)\n", "get_unloaded_pages 1MB",
+            static_cast<double>(unloaded_ns) / ops, (long long) pages);
+    printf("%-36s %10.1f ns/op\n", "set_page_loaded_status split+merge",
+            static_cast<double>(update_ns) / updates / 2);
+    return 0;
+}
@@ -0,0 +1,73 @@
+/**
+ * bosfs - A fuse-based file system implemented on Baidu Object Storage(BOS)
+ *
+ * Copyright (c) 2016 Baidu.com, Inc. All rights reserved.
+ *
+ * @file    bench_util.h
+ * @brief   timing and threading helpers shared by benchmarks
+ **/
+#ifndef BAIDU_BOS_BOSFS_BENCH_UTIL_H
+#define BAIDU_BOS_BOSFS_BENCH_UTIL_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <time.h>
+
+#include <vector>
+
+inline int64_t bench_now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return static_cast<int64_t>(ts.tv_sec) * 1000000000LL + ts.tv_nsec;
+}
+
+// xorshift, cheap enough not to show up in what is measured
+inline uint64_t bench_rand(uint64_t *state) {
+    uint64_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    *state = x;
+    return x;
+}
+
+inline int bench_arg(int argc, char *argv[], int index, int default_value) {
+    return argc > index ? atoi(argv[index]) : default_value;
+}
+
+// run body(thread_index) on threads threads released at once, return wall time in ns
+template <typename Body>
+int64_t bench_run_threads(int threads, Body &body) {
+    struct Context {
+        Body *body;
+        int index;
+        pthread_barrier_t *barrier;
+        static void *run(void *arg) {
+            Context *ctx = reinterpret_cast<Context *>(arg);
+            pthread_barrier_wait(ctx->barrier);
+            (*ctx->body)(ctx->index);
+            return NULL;
+        }
+    };
+    pthread_barrier_t barrier;
+    pthread_barrier_init(&barrier, NULL, threads + 1);
+    std::vector<Context> contexts(threads);
+    std::vector<pthread_t> tids(threads);
+    for (int i = 0; i < threads; ++i) {
+        contexts[i].body = &body;
+        contexts[i].index = i;
+        contexts[i].barrier = &barrier;
+        pthread_create(&tids[i], NULL, Context::run, &contexts[i]);
+    }
+    int64_t start = bench_now_ns();
+    pthread_barrier_wait(&barrier);
+    for (int i = 0; i < threads; ++i) {
+        pthread_join(tids[i], NULL);
+    }
+    int64_t elapsed = bench_now_ns() - start;
+    pthread_barrier_destroy(&barrier);
+    return elapsed;
+}
+
+#endif